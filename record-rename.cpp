@@ -1,33 +1,68 @@
 #include "obs-websocket-api.h"
 #include "record-rename.hpp"
+#include "remux.hpp"
 #include "version.h"
-#include <media-io/media-remux.h>
 #include <obs-frontend-api.h>
 #include <obs-module.h>
 #include <QCompleter>
+#include <QActionGroup>
 #include <QDesktopServices>
 #include <QDialogButtonBox>
+#include <QInputDialog>
 #include <QMainWindow>
 #include <QMenu>
 #include <QRegularExpression>
 #include <QTimer>
 #include <QVBoxLayout>
+#include <algorithm>
+#include <deque>
+#include <ctime>
 #include <string>
+#include <string_view>
 #include <util/config-file.h>
 #include <util/dstr.h>
 #include <util/platform.h>
 #include <util/threading.h>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#define FILE_READY_MIN_DELAY_MS 50
+#define FILE_READY_MAX_DELAY_MS 2000
+#define FILE_READY_TIMEOUT_NS 60000000000ULL
+#define FILE_READY_POLL_MS 100
+#define RENAME_GROUP_WINDOW_NS 1000000000ULL
+
 static bool rename_record_enabled = true;
 static bool rename_replay_enabled = true;
 static bool user_confirm = true;
 static bool auto_remux = false;
+static int remux_format = REMUX_FORMAT_MP4;
+static int replay_keep_seconds = 0;
+static int audio_fanout = 0;
+static bool name_at_start = false;
+static int replay_burst_window = 0;
+static bool write_sidecar = false;
 static std::map<obs_output_t *, std::vector<std::string>> output_files;
 static std::string filename_format;
 
 static std::string vendor_filename_format;
 static bool vendor_force = false;
 
+static bool recording_named_at_start = false;
+static obs_output_t *named_at_start_output = nullptr;
+static std::string restore_filename_formatting;
+static bool restore_overwrite_if_exists = false;
+static bool restore_filename_formatting_pending = false;
+
 static std::string hook_source;
 static std::string hook_title;
 static std::string hook_class;
@@ -60,14 +95,600 @@ std::string hook_format(std::string format)
 	return hf;
 }
 
-void *remux_thread(void *param)
+// Returns 1 while a writer still has the file open, 0 once it is closed and -1
+// when that can not be told on this platform or file system.
+#ifdef _WIN32
+static int file_open_for_writing(const char *path)
+{
+	wchar_t *wpath = nullptr;
+	if (!os_utf8_to_wcs_ptr(path, 0, &wpath))
+		return -1;
+	// denying write sharing fails with a sharing violation while the writer has it open
+	HANDLE handle = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	bfree(wpath);
+	if (handle == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_SHARING_VIOLATION ? 1 : -1;
+	CloseHandle(handle);
+	return 0;
+}
+#elif defined(__linux__)
+static int file_open_for_writing(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	// a read lease can only be taken while nobody has the file open for writing
+	int result = -1;
+	if (fcntl(fd, F_SETLEASE, F_RDLCK) == 0) {
+		fcntl(fd, F_SETLEASE, F_UNLCK);
+		result = 0;
+	} else if (errno == EAGAIN) {
+		result = 1;
+	}
+	close(fd);
+	return result;
+}
+#else
+static int file_open_for_writing(const char *path)
+{
+	UNUSED_PARAMETER(path);
+	return -1;
+}
+#endif
+
+static bool sleep_unless_canceled(uint32_t ms, volatile bool *cancel)
+{
+	for (uint32_t slept = 0; slept < ms; slept += FILE_READY_POLL_MS) {
+		if (os_atomic_load_bool(cancel))
+			return false;
+		os_sleep_ms(ms - slept < FILE_READY_POLL_MS ? ms - slept : FILE_READY_POLL_MS);
+	}
+	return !os_atomic_load_bool(cancel);
+}
+
+// Waits until the writer has closed the file. On Linux, when the lease probe shows
+// a writer, only IN_CLOSE_WRITE or the timeout mark the file ready. Otherwise the
+// writer is probed with exponential backoff, falling back to size stability when
+// the probe can not tell. Returns false when the file no longer exists or cancel is set.
+static bool wait_for_file_ready(const char *path, volatile bool *cancel)
+{
+	if (!os_file_exists(path))
+		return false;
+	uint64_t deadline = os_gettime_ns() + FILE_READY_TIMEOUT_NS;
+#ifdef __linux__
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	if (fd >= 0 && inotify_add_watch(fd, path, IN_CLOSE_WRITE) >= 0) {
+		// checked once after the watch is in place, so a close in between is not missed
+		int open_for_writing = file_open_for_writing(path);
+		// without lease support the file is usually closed already and no close event
+		// would come, size stability below decides instead
+		if (open_for_writing >= 0) {
+			bool ready = open_for_writing == 0;
+			while (!ready && !os_atomic_load_bool(cancel)) {
+				struct pollfd pfd = {fd, POLLIN, 0};
+				if (poll(&pfd, 1, FILE_READY_POLL_MS) > 0) {
+					ready = true;
+				} else if (!os_file_exists(path)) {
+					break;
+				} else if (os_gettime_ns() > deadline) {
+					blog(LOG_WARNING, "[Record Rename] Timeout waiting for writer to finish: %s", path);
+					ready = true;
+				}
+			}
+			close(fd);
+			return ready && os_file_exists(path);
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+#endif
+	int64_t last_size = os_get_file_size(path);
+	uint32_t delay = FILE_READY_MIN_DELAY_MS;
+	int stable_count = 0;
+	for (;;) {
+		int open_for_writing = file_open_for_writing(path);
+		if (open_for_writing == 0)
+			return true;
+		if (!sleep_unless_canceled(delay, cancel))
+			return false;
+		int64_t size = os_get_file_size(path);
+		if (size < 0)
+			return false;
+		stable_count = open_for_writing < 0 && size == last_size ? stable_count + 1 : 0;
+		last_size = size;
+		if (stable_count >= 2)
+			return true;
+		if (os_gettime_ns() > deadline) {
+			blog(LOG_WARNING, "[Record Rename] Timeout waiting for writer to finish: %s", path);
+			return true;
+		}
+		if (delay < FILE_READY_MAX_DELAY_MS)
+			delay = delay * 2 > FILE_READY_MAX_DELAY_MS ? FILE_READY_MAX_DELAY_MS : delay * 2;
+	}
+}
+
+struct ready_task {
+	std::vector<std::string> paths;
+	obs_task_t task;
+	void *param;
+	// frees param when the task is dropped on unload
+	void (*destroy)(void *param);
+};
+
+static std::deque<ready_task> ready_queue;
+static pthread_mutex_t ready_mutex;
+static os_sem_t *ready_sem = nullptr;
+static pthread_t ready_worker;
+static bool ready_worker_active = false;
+static volatile bool ready_stopping = false;
+
+void *ready_worker_thread(void *param)
+{
+	UNUSED_PARAMETER(param);
+	os_set_thread_name("record-rename: wait for files");
+	while (os_sem_wait(ready_sem) == 0) {
+		if (os_atomic_load_bool(&ready_stopping))
+			break;
+		pthread_mutex_lock(&ready_mutex);
+		if (ready_queue.empty()) {
+			pthread_mutex_unlock(&ready_mutex);
+			continue;
+		}
+		ready_task rt = std::move(ready_queue.front());
+		ready_queue.pop_front();
+		pthread_mutex_unlock(&ready_mutex);
+
+		for (const std::string &path : rt.paths) {
+			if (!wait_for_file_ready(path.c_str(), &ready_stopping) && !os_atomic_load_bool(&ready_stopping))
+				blog(LOG_ERROR, "[Record Rename] File not found: %s", path.c_str());
+		}
+		if (os_atomic_load_bool(&ready_stopping)) {
+			if (rt.destroy)
+				rt.destroy(rt.param);
+			break;
+		}
+		obs_queue_task(OBS_TASK_UI, rt.task, rt.param, false);
+	}
+	return nullptr;
+}
+
+// Queues the UI task once the writer has closed all files, without blocking the caller.
+// Tasks are handled in order by a single worker.
+void queue_when_ready(std::vector<std::string> paths, obs_task_t task, void *param, void (*destroy)(void *) = nullptr)
+{
+	if (os_atomic_load_bool(&ready_stopping)) {
+		if (destroy)
+			destroy(param);
+		return;
+	}
+	if (!ready_worker_active) {
+		obs_queue_task(OBS_TASK_UI, task, param, false);
+		return;
+	}
+	pthread_mutex_lock(&ready_mutex);
+	ready_queue.push_back({std::move(paths), task, param, destroy});
+	pthread_mutex_unlock(&ready_mutex);
+	os_sem_post(ready_sem);
+}
+
+void start_ready_worker()
+{
+	pthread_mutex_init(&ready_mutex, nullptr);
+	os_atomic_set_bool(&ready_stopping, false);
+	if (os_sem_init(&ready_sem, 0) != 0) {
+		ready_sem = nullptr;
+		return;
+	}
+	if (pthread_create(&ready_worker, nullptr, ready_worker_thread, nullptr) == 0)
+		ready_worker_active = true;
+}
+
+// Must run before anything a queued UI task touches is torn down.
+void stop_ready_worker()
+{
+	os_atomic_set_bool(&ready_stopping, true);
+	if (ready_worker_active) {
+		os_sem_post(ready_sem);
+		pthread_join(ready_worker, nullptr);
+		ready_worker_active = false;
+	}
+	for (ready_task &rt : ready_queue) {
+		if (rt.destroy)
+			rt.destroy(rt.param);
+	}
+	ready_queue.clear();
+	os_sem_destroy(ready_sem);
+	ready_sem = nullptr;
+	pthread_mutex_destroy(&ready_mutex);
+}
+
+struct sidecar_entry {
+	std::string path;
+	obs_data_t *data;
+	std::string base;
+};
+
+static std::vector<sidecar_entry> sidecar_queue;
+static pthread_mutex_t sidecar_mutex;
+static os_event_t *sidecar_event = nullptr;
+static pthread_t sidecar_thread;
+static bool sidecar_thread_active = false;
+static volatile bool sidecar_stopping = false;
+
+static void write_sidecars(std::vector<sidecar_entry> &entries)
+{
+	for (sidecar_entry &entry : entries) {
+		obs_data_t *data = entry.data;
+		if (!entry.base.empty()) {
+			std::string base_path = entry.base + ".json";
+			obs_data_t *base = os_file_exists(base_path.c_str()) ? obs_data_create_from_json_file(base_path.c_str())
+									      : nullptr;
+			if (base) {
+				obs_data_apply(base, entry.data);
+				obs_data_release(entry.data);
+				data = base;
+			}
+		}
+		std::string path = entry.path + ".json";
+		// written to a temp file first and then moved in place
+		if (!obs_data_save_json_safe(data, path.c_str(), "tmp", nullptr))
+			blog(LOG_WARNING, "[Record Rename] Failed to write sidecar: %s", path.c_str());
+		obs_data_release(data);
+	}
+	entries.clear();
+}
+
+void *sidecar_write_thread(void *param)
+{
+	UNUSED_PARAMETER(param);
+	os_set_thread_name("record-rename: sidecar");
+	std::vector<sidecar_entry> entries;
+	while (os_event_wait(sidecar_event) == 0) {
+		pthread_mutex_lock(&sidecar_mutex);
+		entries.swap(sidecar_queue);
+		pthread_mutex_unlock(&sidecar_mutex);
+		write_sidecars(entries);
+		if (os_atomic_load_bool(&sidecar_stopping))
+			break;
+	}
+	return nullptr;
+}
+
+// Takes ownership of data. When base is set the sidecar of base is merged in
+// first, so facts gathered at rename time carry over to the remuxed file.
+void queue_sidecar(const std::string &path, obs_data_t *data, const std::string &base = std::string())
+{
+	pthread_mutex_lock(&sidecar_mutex);
+	sidecar_queue.push_back({path, data, base});
+	pthread_mutex_unlock(&sidecar_mutex);
+	if (sidecar_event)
+		os_event_signal(sidecar_event);
+}
+
+void queue_file_sidecar(const std::string &path, const std::string &orig_path, obs_output_t *output, size_t segment)
+{
+	if (!write_sidecar)
+		return;
+	obs_data_t *data = obs_data_create();
+	const char *output_name = output ? obs_output_get_name(output) : nullptr;
+	if (output_name)
+		obs_data_set_string(data, "output", output_name);
+	if (segment)
+		obs_data_set_int(data, "segment", (long long)segment);
+	if (!hook_title.empty())
+		obs_data_set_string(data, "hook_title", hook_title.c_str());
+	if (!hook_executable.empty())
+		obs_data_set_string(data, "hook_executable", hook_executable.c_str());
+	if (path != orig_path) {
+		obs_data_set_string(data, "original_file", orig_path.c_str());
+		obs_data_set_int(data, "renamed_at", (long long)time(nullptr));
+	}
+	queue_sidecar(path, data);
+}
+
+void start_sidecar_thread()
+{
+	pthread_mutex_init(&sidecar_mutex, nullptr);
+	os_atomic_set_bool(&sidecar_stopping, false);
+	if (os_event_init(&sidecar_event, OS_EVENT_TYPE_AUTO) != 0) {
+		sidecar_event = nullptr;
+		return;
+	}
+	if (pthread_create(&sidecar_thread, nullptr, sidecar_write_thread, nullptr) == 0)
+		sidecar_thread_active = true;
+}
+
+void stop_sidecar_thread()
+{
+	os_atomic_set_bool(&sidecar_stopping, true);
+	if (sidecar_thread_active) {
+		os_event_signal(sidecar_event);
+		pthread_join(sidecar_thread, nullptr);
+		sidecar_thread_active = false;
+	}
+	write_sidecars(sidecar_queue);
+	if (sidecar_event) {
+		os_event_destroy(sidecar_event);
+		sidecar_event = nullptr;
+	}
+	pthread_mutex_destroy(&sidecar_mutex);
+}
+
+struct remux_job {
+	std::string source;
+	std::string target;
+	int format;
+	double keep_last_seconds;
+	unsigned int audio_tracks;
+};
+
+static std::deque<remux_job> remux_queue;
+static pthread_mutex_t remux_mutex;
+static os_sem_t *remux_sem = nullptr;
+static pthread_t remux_worker;
+static bool remux_worker_active = false;
+static volatile bool remux_stopping = false;
+// set when remux_queue changed since the journal was last written
+static bool remux_journal_dirty = false;
+
+// The journal holds every job that has not finished yet, including the one
+// being processed, so a crash or shutdown mid-remux can be resumed on load.
+static std::string remux_journal_path()
+{
+	// there is no module when the sources are built into the soak harness
+	if (!obs_current_module())
+		return std::string();
+	char *path = obs_module_config_path("remux-queue.json");
+	std::string result = path ? path : "";
+	bfree(path);
+	return result;
+}
+
+// name.part.mp4 for name.mp4, the remuxer picks the container from the extension
+static std::string remux_part_path(const std::string &target)
+{
+	size_t extension_pos = target.find_last_of('.');
+	if (extension_pos == std::string::npos)
+		return target + ".part";
+	return target.substr(0, extension_pos) + ".part" + target.substr(extension_pos);
+}
+
+static void save_remux_journal(const std::deque<remux_job> &queue)
+{
+	std::string path = remux_journal_path();
+	if (path.empty())
+		return;
+	if (queue.empty()) {
+		if (os_file_exists(path.c_str()))
+			os_unlink(path.c_str());
+		return;
+	}
+	obs_data_t *data = obs_data_create();
+	obs_data_array_t *jobs = obs_data_array_create();
+	for (const remux_job &job : queue) {
+		obs_data_t *item = obs_data_create();
+		obs_data_set_string(item, "source", job.source.c_str());
+		obs_data_set_string(item, "target", job.target.c_str());
+		obs_data_set_int(item, "format", job.format);
+		obs_data_set_double(item, "keep_last_seconds", job.keep_last_seconds);
+		obs_data_set_int(item, "audio_tracks", job.audio_tracks);
+		obs_data_array_push_back(jobs, item);
+		obs_data_release(item);
+	}
+	obs_data_set_array(data, "jobs", jobs);
+	obs_data_array_release(jobs);
+	if (!obs_data_save_json_safe(data, path.c_str(), "tmp", "bak"))
+		blog(LOG_WARNING, "[Record Rename] Failed to save remux queue: %s", path.c_str());
+	obs_data_release(data);
+}
+
+// Only called from the remux worker, so enqueuing never waits on the disk and
+// the writes stay in order.
+static void flush_remux_journal()
+{
+	pthread_mutex_lock(&remux_mutex);
+	if (!remux_journal_dirty) {
+		pthread_mutex_unlock(&remux_mutex);
+		return;
+	}
+	std::deque<remux_job> queue = remux_queue;
+	remux_journal_dirty = false;
+	pthread_mutex_unlock(&remux_mutex);
+	save_remux_journal(queue);
+}
+
+static void load_remux_journal()
+{
+	std::string path = remux_journal_path();
+	if (path.empty() || !os_file_exists(path.c_str()))
+		return;
+	obs_data_t *data = obs_data_create_from_json_file_safe(path.c_str(), "bak");
+	if (!data)
+		return;
+	obs_data_array_t *jobs = obs_data_get_array(data, "jobs");
+	size_t count = obs_data_array_count(jobs);
+	for (size_t i = 0; i < count; i++) {
+		obs_data_t *item = obs_data_array_item(jobs, i);
+		remux_job job;
+		job.source = obs_data_get_string(item, "source");
+		job.target = obs_data_get_string(item, "target");
+		job.format = (int)obs_data_get_int(item, "format");
+		job.keep_last_seconds = obs_data_get_double(item, "keep_last_seconds");
+		job.audio_tracks = (unsigned int)obs_data_get_int(item, "audio_tracks");
+		obs_data_release(item);
+		if (job.source.empty() || job.target.empty())
+			continue;
+		if (!os_file_exists(job.source.c_str())) {
+			blog(LOG_WARNING, "[Record Rename] Dropping remux of missing file: %s", job.source.c_str());
+			continue;
+		}
+		// whatever is at the temporary target was left behind by an interrupted remux
+		if (job.audio_tracks)
+			remux_remove_track_parts(job.target.substr(0, job.target.find_last_of('.')).c_str(), job.audio_tracks);
+		std::string part = remux_part_path(job.target);
+		if (os_file_exists(part.c_str())) {
+			os_unlink(part.c_str());
+		} else if (job.target != job.source && os_file_exists(job.target.c_str())) {
+			// moved into place before the journal was updated
+			blog(LOG_INFO, "[Record Rename] Skipping finished remux of %s", job.source.c_str());
+			continue;
+		}
+		remux_queue.push_back(job);
+	}
+	obs_data_array_release(jobs);
+	obs_data_release(data);
+	if (!remux_queue.empty())
+		blog(LOG_INFO, "[Record Rename] Resuming %zu unfinished remux job(s)", remux_queue.size());
+	save_remux_journal(remux_queue);
+}
+
+static bool remux_progress(void *data, float percent)
 {
-	media_remux_job_t mr_job = (media_remux_job_t)param;
-	media_remux_job_process(mr_job, nullptr, nullptr);
-	media_remux_job_destroy(mr_job);
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(percent);
+	// jobs queued during a long remux are journaled without waiting for it
+	flush_remux_journal();
+	return !os_atomic_load_bool(&remux_stopping);
+}
+
+void *remux_worker_thread(void *param)
+{
+	UNUSED_PARAMETER(param);
+	os_set_thread_name("record-rename: remux");
+	while (os_sem_wait(remux_sem) == 0) {
+		if (os_atomic_load_bool(&remux_stopping))
+			break;
+		flush_remux_journal();
+		pthread_mutex_lock(&remux_mutex);
+		if (remux_queue.empty()) {
+			pthread_mutex_unlock(&remux_mutex);
+			continue;
+		}
+		remux_job job = remux_queue.front();
+		pthread_mutex_unlock(&remux_mutex);
+
+		// extracted audio tracks are named after the final target
+		std::string track_base = job.target.substr(0, job.target.find_last_of('.'));
+		remux_options options = {job.format, job.keep_last_seconds, job.audio_tracks, track_base.c_str()};
+		// written next to the target first, the target can be the source when trimming
+		std::string part = remux_part_path(job.target);
+		remux_result result = REMUX_FAILED;
+		if (wait_for_file_ready(job.source.c_str(), &remux_stopping))
+			result = remux_file(job.source.c_str(), part.c_str(), options, remux_progress, nullptr);
+		bool success = result == REMUX_UNCHANGED ||
+			       (result == REMUX_SUCCESS && os_rename(part.c_str(), job.target.c_str()) == 0);
+		// leave an interrupted job in the journal so it is resumed on next load
+		if (!success && os_atomic_load_bool(&remux_stopping))
+			break;
+		if (result == REMUX_UNCHANGED && job.audio_tracks) {
+			blog(LOG_INFO, "[Record Rename] Extracted audio tracks from %s", job.source.c_str());
+		} else if (result == REMUX_UNCHANGED) {
+			blog(LOG_INFO, "[Record Rename] Nothing to remux for %s", job.source.c_str());
+		} else if (!success) {
+			blog(LOG_WARNING, "[Record Rename] Failed to remux %s to %s", job.source.c_str(), job.target.c_str());
+			if (os_file_exists(part.c_str()))
+				os_unlink(part.c_str());
+		} else if (write_sidecar) {
+			obs_data_t *data = obs_data_create();
+			obs_data_set_string(data, "remuxed_from", job.source.c_str());
+			obs_data_set_int(data, "remuxed_at", (long long)time(nullptr));
+			queue_sidecar(job.target, data, job.source);
+		}
+
+		pthread_mutex_lock(&remux_mutex);
+		remux_queue.pop_front();
+		remux_journal_dirty = true;
+		pthread_mutex_unlock(&remux_mutex);
+		flush_remux_journal();
+	}
 	return nullptr;
 }
 
+bool is_replay_output(obs_output_t *output)
+{
+	return output && strcmp(obs_output_get_id(output), "replay_buffer") == 0;
+}
+
+bool needs_remux(const std::string &path, bool replay)
+{
+	size_t extension_pos = path.find_last_of('.');
+	if (extension_pos == std::string::npos)
+		return false;
+	if (replay && replay_keep_seconds > 0)
+		return true;
+	if (audio_fanout)
+		return true;
+	return auto_remux && path.substr(extension_pos) != remux_format_extension(remux_format);
+}
+
+// Replay saves are trimmed in the same pass. Without AutoRemux, or when the recording
+// already is in the target container, the container stays and only audio tracks are extracted.
+remux_job make_remux_job(const std::string &path, bool replay)
+{
+	size_t extension_pos = path.find_last_of('.');
+	double keep_last_seconds = replay ? (double)replay_keep_seconds : 0.0;
+	if (!auto_remux || path.substr(extension_pos) == remux_format_extension(remux_format))
+		return {path, path, REMUX_FORMAT_SOURCE, keep_last_seconds, (unsigned int)audio_fanout};
+	return {path, path.substr(0, extension_pos) + remux_format_extension(remux_format), remux_format, keep_last_seconds,
+		(unsigned int)audio_fanout};
+}
+
+void queue_remux(const std::vector<remux_job> &jobs)
+{
+	if (jobs.empty())
+		return;
+	pthread_mutex_lock(&remux_mutex);
+	for (const remux_job &job : jobs)
+		remux_queue.push_back(job);
+	remux_journal_dirty = true;
+	pthread_mutex_unlock(&remux_mutex);
+	for (size_t i = 0; i < jobs.size(); i++)
+		os_sem_post(remux_sem);
+}
+
+void start_remux_worker()
+{
+	pthread_mutex_init(&remux_mutex, nullptr);
+	os_sem_init(&remux_sem, 0);
+	os_atomic_set_bool(&remux_stopping, false);
+	// obs_module_config_path does not create the plugin config directory
+	char *config_dir = obs_current_module() ? obs_module_config_path("") : nullptr;
+	if (config_dir && os_mkdirs(config_dir) == MKDIR_ERROR)
+		blog(LOG_WARNING, "[Record Rename] Failed to create %s, the remux queue is not saved", config_dir);
+	bfree(config_dir);
+	load_remux_journal();
+	if (pthread_create(&remux_worker, nullptr, remux_worker_thread, nullptr) == 0)
+		remux_worker_active = true;
+	for (size_t i = 0; i < remux_queue.size(); i++)
+		os_sem_post(remux_sem);
+}
+
+void stop_remux_worker()
+{
+	os_atomic_set_bool(&remux_stopping, true);
+	if (remux_worker_active) {
+		os_sem_post(remux_sem);
+		pthread_join(remux_worker, nullptr);
+		remux_worker_active = false;
+	}
+	// jobs queued after the worker last wrote the journal
+	flush_remux_journal();
+	os_sem_destroy(remux_sem);
+	remux_sem = nullptr;
+	pthread_mutex_destroy(&remux_mutex);
+}
+
+static void sanitize_filename(std::string &filename)
+{
+	std::replace(filename.begin(), filename.end(), '<', '_');
+	std::replace(filename.begin(), filename.end(), '>', '_');
+	std::replace(filename.begin(), filename.end(), ':', '_');
+	std::replace(filename.begin(), filename.end(), '"', '_');
+	std::replace(filename.begin(), filename.end(), '|', '_');
+	std::replace(filename.begin(), filename.end(), '?', '_');
+	std::replace(filename.begin(), filename.end(), '*', '_');
+}
+
 static void ensure_directory(char *path)
 {
 #ifdef _WIN32
@@ -89,214 +710,348 @@ static void ensure_directory(char *path)
 #endif
 }
 
-void ask_rename_file_UI(void *param)
+struct path_parts {
+	std::string_view folder;
+	std::string_view stem;
+	std::string_view extension;
+};
+
+// Splits without copying, the parts point into path.
+static path_parts split_path(std::string_view path)
 {
-	std::string path = (char *)param;
-	bfree(param);
-	const auto main_window = static_cast<QWidget *>(obs_frontend_get_main_window());
-	size_t extension_pos = -1;
-	size_t slash_pos = -1;
-	for (size_t pos = path.length(); pos > 0; pos--) {
-		auto c = path[pos - 1];
-		if (c == '.' && extension_pos == (size_t)-1) {
-			extension_pos = pos;
-		} else if (c == '/' || c == '\\') {
-			slash_pos = pos;
-			break;
-		}
-	}
-	std::string filename;
-	std::string extension;
-	std::string folder;
-	if (extension_pos != (size_t)-1) {
-		filename = path.substr(0, extension_pos - 1);
-		extension = path.substr(extension_pos - 1);
-	} else {
-		filename = path;
-	}
-	if (slash_pos != (size_t)-1) {
-		folder = filename.substr(0, slash_pos);
-		filename = filename.substr(slash_pos);
-	}
-	std::string orig_filename = filename;
-	bool force = false;
+	size_t slash_pos = path.find_last_of("/\\");
+	size_t name_start = slash_pos == std::string_view::npos ? 0 : slash_pos + 1;
+	size_t extension_pos = path.find_last_of('.');
+	if (extension_pos == std::string_view::npos || extension_pos < name_start)
+		extension_pos = path.size();
+	return {path.substr(0, name_start), path.substr(name_start, extension_pos - name_start), path.substr(extension_pos)};
+}
+
+static std::string resolve_filename(const std::string &orig_filename, bool &force)
+{
+	std::string filename = orig_filename;
+	std::string format = filename_format;
+	force = false;
 	if (!vendor_filename_format.empty()) {
-		std::string hf = hook_format(vendor_filename_format);
-		char *formatted = os_generate_formatted_filename(nullptr, true, hf.c_str());
-		if (formatted) {
-			filename = formatted;
-			bfree(formatted);
-		}
+		format = vendor_filename_format;
 		force = vendor_force;
 		vendor_filename_format.clear();
-	} else if (!filename_format.empty()) {
-		std::string hf = hook_format(filename_format);
+	}
+	if (!format.empty()) {
+		std::string hf = hook_format(format);
 		char *formatted = os_generate_formatted_filename(nullptr, true, hf.c_str());
 		if (formatted) {
 			filename = formatted;
 			bfree(formatted);
 		}
 	}
-	std::replace(filename.begin(), filename.end(), '<', '_');
-	std::replace(filename.begin(), filename.end(), '>', '_');
-	std::replace(filename.begin(), filename.end(), ':', '_');
-	std::replace(filename.begin(), filename.end(), '"', '_');
-	std::replace(filename.begin(), filename.end(), '|', '_');
-	std::replace(filename.begin(), filename.end(), '?', '_');
-	std::replace(filename.begin(), filename.end(), '*', '_');
+	return filename;
+}
 
-	std::string new_path = folder + filename + extension;
-	if ((!force || os_file_exists(new_path.c_str())) && user_confirm) {
-		do {
-			std::string title = obs_module_text("RenameFile");
-			if (filename != orig_filename && os_file_exists(new_path.c_str())) {
-				title += ": ";
-				title += obs_module_text("FileExists");
-			}
-			if (!RenameFileDialog::AskForName(main_window, title, filename))
-				filename = orig_filename;
-			new_path = folder + filename + extension;
-		} while (filename != orig_filename && os_file_exists(new_path.c_str()));
-	}
-	if (filename != orig_filename) {
-		struct dstr dir_path;
-		dstr_init_copy(&dir_path, new_path.c_str());
-		ensure_directory(dir_path.array);
-		dstr_free(&dir_path);
-		os_rename(path.c_str(), new_path.c_str());
-	}
-
-	if (auto_remux && extension != ".mp4") {
-		media_remux_job_t mr_job = nullptr;
-		std::string target = folder + filename + ".mp4";
-		if (media_remux_job_create(&mr_job, new_path.c_str(), target.c_str())) {
-			pthread_t thread;
-			pthread_create(&thread, nullptr, remux_thread, mr_job);
-		}
+void queue_remux_files(const std::vector<std::string> &files)
+{
+	std::vector<remux_job> remux_jobs;
+	for (const std::string &fp : files) {
+		if (needs_remux(fp, false))
+			remux_jobs.push_back(make_remux_job(fp, false));
+	}
+	queue_remux(remux_jobs);
+}
+
+struct rename_entry {
+	obs_output_t *output;
+	std::string path;
+	// appended to the name, used for the other outputs of a group
+	std::string suffix;
+	// 1 based index for split and burst files, 0 for a single file
+	size_t segment;
+	std::string new_path;
+};
+
+// Single files, split recordings, replay bursts and output groups all go
+// through the same stages: resolve name, validate, move and post-process.
+struct rename_job {
+	std::vector<rename_entry> entries;
+	std::string orig_name;
+	std::string name;
+	bool force = false;
+	std::string scratch;
+};
+
+static void add_rename_entries(rename_job &job, obs_output_t *output, const std::vector<std::string> &files, bool numbered,
+			       const std::string &suffix = std::string())
+{
+	job.entries.reserve(job.entries.size() + files.size());
+	for (size_t i = 0; i < files.size(); i++)
+		job.entries.push_back({output, files[i], suffix, numbered ? i + 1 : 0, std::string()});
+}
+
+static const std::string &rename_target(rename_job &job, const rename_entry &entry, std::string_view name)
+{
+	path_parts parts = split_path(entry.path);
+	std::string &target = job.scratch;
+	target.clear();
+	target.append(parts.folder).append(name).append(entry.suffix);
+	if (entry.segment) {
+		char index[32];
+		snprintf(index, sizeof(index), " (%zu)", entry.segment);
+		target.append(index);
 	}
+	target.append(parts.extension);
+	return target;
 }
 
-void *remux_multiple_thread(void *param)
+static bool rename_target_exists(rename_job &job, std::string_view name)
 {
-	std::vector<std::string> *remux = (std::vector<std::string> *)param;
-	for (const std::string &fp : *remux) {
-		media_remux_job_t mr_job = nullptr;
-		std::string target = fp.substr(0, fp.find_last_of('.')) + ".mp4";
-		if (media_remux_job_create(&mr_job, fp.c_str(), target.c_str())) {
-			media_remux_job_process(mr_job, nullptr, nullptr);
-			media_remux_job_destroy(mr_job);
-		}
+	for (const rename_entry &entry : job.entries) {
+		if (os_file_exists(rename_target(job, entry, name).c_str()))
+			return true;
 	}
-	delete remux;
-	return nullptr;
+	return false;
 }
 
-void ask_rename_files_UI(void *param)
+static void resolve_rename_job(rename_job &job)
 {
-	obs_output_t *output = (obs_output_t *)param;
-	auto t = output_files.find(output);
-	if (t == output_files.end() || t->second.empty())
+	job.orig_name = split_path(job.entries.front().path).stem;
+	job.name = resolve_filename(job.orig_name, job.force);
+	sanitize_filename(job.name);
+}
+
+static void validate_rename_job(rename_job &job)
+{
+	if ((job.force && !rename_target_exists(job, job.name)) || !user_confirm)
 		return;
 	const auto main_window = static_cast<QWidget *>(obs_frontend_get_main_window());
-	std::string path = t->second.front();
-	size_t extension_pos = -1;
-	size_t slash_pos = -1;
-	for (size_t pos = path.length(); pos > 0; pos--) {
-		auto c = path[pos - 1];
-		if (c == '.' && extension_pos == (size_t)-1) {
-			extension_pos = pos;
-		} else if (c == '/' || c == '\\') {
-			slash_pos = pos;
-			break;
-		}
-	}
-	std::string filename;
-	std::string extension;
-	std::string folder;
-	if (extension_pos != (size_t)-1) {
-		filename = path.substr(0, extension_pos - 1);
-		extension = path.substr(extension_pos - 1);
-	} else {
-		filename = path;
-	}
-	if (slash_pos != (size_t)-1) {
-		folder = filename.substr(0, slash_pos);
-		filename = filename.substr(slash_pos);
-	}
-	std::string orig_filename = filename;
-	bool force = false;
-	if (!vendor_filename_format.empty()) {
-		std::string hf = hook_format(vendor_filename_format);
-		char *formatted = os_generate_formatted_filename(nullptr, true, hf.c_str());
-		if (formatted) {
-			filename = formatted;
-			bfree(formatted);
-		}
-		force = vendor_force;
-		vendor_filename_format.clear();
-	} else if (!filename_format.empty()) {
-		std::string hf = hook_format(filename_format);
-		char *formatted = os_generate_formatted_filename(nullptr, true, hf.c_str());
-		if (formatted) {
-			filename = formatted;
-			bfree(formatted);
-		}
-	}
-	std::string new_path = folder + filename + " (1)" + extension;
-	if (!force || os_file_exists(new_path.c_str())) {
-		do {
-			std::string title = obs_module_text("RenameFiles");
+	do {
+		std::string title;
+		if (job.entries.size() == 1) {
+			title = obs_module_text("RenameFile");
+		} else {
+			title = obs_module_text("RenameFiles");
 			title += " (";
-			title += std::to_string(t->second.size());
+			title += std::to_string(job.entries.size());
 			title += " ";
 			title += obs_module_text("Files");
 			title += ")";
-			if (filename != orig_filename && os_file_exists(new_path.c_str())) {
-				title += ": ";
-				title += obs_module_text("FileExists");
+		}
+		if (job.name != job.orig_name && rename_target_exists(job, job.name)) {
+			title += ": ";
+			title += obs_module_text("FileExists");
+		}
+		if (!RenameFileDialog::AskForName(main_window, title, job.name))
+			job.name = job.orig_name;
+		sanitize_filename(job.name);
+	} while (job.name != job.orig_name && rename_target_exists(job, job.name));
+}
+
+static void move_rename_job(rename_job &job)
+{
+	bool rename = job.name != job.orig_name;
+	for (rename_entry &entry : job.entries) {
+		if (rename) {
+			entry.new_path = rename_target(job, entry, job.name);
+			struct dstr dir_path;
+			dstr_init_copy(&dir_path, entry.new_path.c_str());
+			ensure_directory(dir_path.array);
+			dstr_free(&dir_path);
+			if (os_rename(entry.path.c_str(), entry.new_path.c_str()) != 0) {
+				blog(LOG_WARNING, "[Record Rename] Failed to rename %s to %s", entry.path.c_str(),
+				     entry.new_path.c_str());
+				entry.new_path = entry.path;
 			}
-			if (!RenameFileDialog::AskForName(main_window, title, filename))
-				filename = orig_filename;
+		} else {
+			entry.new_path = entry.path;
+		}
+	}
+}
 
-			new_path = folder + filename + " (1)" + extension;
-		} while (filename != orig_filename && os_file_exists(new_path.c_str()));
+static void post_process_rename_job(rename_job &job)
+{
+	std::vector<remux_job> remux_jobs;
+	for (const rename_entry &entry : job.entries) {
+		queue_file_sidecar(entry.new_path, entry.path, entry.output, entry.segment);
+		bool replay = is_replay_output(entry.output);
+		if (needs_remux(entry.new_path, replay))
+			remux_jobs.push_back(make_remux_job(entry.new_path, replay));
 	}
+	queue_remux(remux_jobs);
+}
 
-	std::vector<std::string> *remux = (auto_remux && extension != ".mp4") ? new std::vector<std::string>() : nullptr;
+void run_rename_job(rename_job &job)
+{
+	job.entries.erase(std::remove_if(job.entries.begin(), job.entries.end(),
+					 [](const rename_entry &entry) { return !os_file_exists(entry.path.c_str()); }),
+			  job.entries.end());
+	if (job.entries.empty())
+		return;
+	resolve_rename_job(job);
+	validate_rename_job(job);
+	move_rename_job(job);
+	post_process_rename_job(job);
+}
 
-	if (filename != orig_filename) {
-		size_t i = 1;
-		for (const std::string &fp : t->second) {
-			new_path = folder + filename + " (" + std::to_string(i) + ")" + extension;
-			if (remux)
-				remux->emplace_back(new_path);
-			os_rename(fp.c_str(), new_path.c_str());
-			i++;
-		}
+struct rename_file_item {
+	obs_output_t *output;
+	std::string path;
+};
+
+static void free_rename_file_item(void *param)
+{
+	delete (rename_file_item *)param;
+}
+
+void ask_rename_file_UI(void *param)
+{
+	rename_file_item *item = (rename_file_item *)param;
+	rename_job job;
+	add_rename_entries(job, item->output, {item->path}, false);
+	delete item;
+	run_rename_job(job);
+}
+
+struct rename_group_member {
+	obs_output_t *output;
+	std::string name;
+	bool split;
+	std::vector<std::string> files;
+	bool ready;
+};
+
+static std::vector<rename_group_member> rename_group;
+static uint64_t rename_group_start = 0;
+static pthread_mutex_t rename_group_mutex;
+
+// Renames the files of all outputs that stopped together with one prompt. The
+// frontend recording output keeps the plain name, other outputs get their name
+// as suffix.
+void ask_rename_group_UI(std::vector<rename_group_member> &members)
+{
+	obs_output_t *recording_output = obs_frontend_get_recording_output();
+	obs_output_release(recording_output);
+	auto primary = std::find_if(members.begin(), members.end(),
+				    [recording_output](const rename_group_member &m) { return m.output == recording_output; });
+	if (primary != members.end())
+		std::iter_swap(members.begin(), primary);
+
+	rename_job job;
+	for (size_t i = 0; i < members.size(); i++) {
+		rename_group_member &member = members[i];
+		add_rename_entries(job, member.output, member.files, member.split, i ? " - " + member.name : std::string());
+	}
+	run_rename_job(job);
+}
+
+void flush_rename_group()
+{
+	pthread_mutex_lock(&rename_group_mutex);
+	bool ready = std::all_of(rename_group.begin(), rename_group.end(), [](const rename_group_member &m) { return m.ready; });
+	if (rename_group.empty() || !ready || os_gettime_ns() < rename_group_start + RENAME_GROUP_WINDOW_NS) {
+		pthread_mutex_unlock(&rename_group_mutex);
+		return;
 	}
+	std::vector<rename_group_member> members;
+	members.swap(rename_group);
+	pthread_mutex_unlock(&rename_group_mutex);
+
+	if (!members.empty())
+		ask_rename_group_UI(members);
+}
 
-	if (remux) {
-		pthread_t thread;
-		pthread_create(&thread, nullptr, remux_multiple_thread, remux);
+void rename_group_member_ready(void *param)
+{
+	obs_output_t *output = (obs_output_t *)param;
+	pthread_mutex_lock(&rename_group_mutex);
+	for (rename_group_member &member : rename_group) {
+		if (member.output == output)
+			member.ready = true;
 	}
-	output_files.erase(output);
+	uint64_t now = os_gettime_ns();
+	uint64_t end = rename_group_start + RENAME_GROUP_WINDOW_NS;
+	pthread_mutex_unlock(&rename_group_mutex);
+	int delay = end > now ? (int)((end - now) / 1000000) + 1 : 0;
+	QTimer::singleShot(delay, [] { flush_rename_group(); });
 }
 
-void ask_rename_file(std::string path)
+// Outputs that stop within RENAME_GROUP_WINDOW_NS of each other are renamed as one group.
+void join_rename_group(obs_output_t *output, bool split, const std::vector<std::string> &files)
+{
+	pthread_mutex_lock(&rename_group_mutex);
+	if (rename_group.empty())
+		rename_group_start = os_gettime_ns();
+	const char *name = obs_output_get_name(output);
+	rename_group.push_back({output, name ? name : "", split, files, false});
+	pthread_mutex_unlock(&rename_group_mutex);
+	queue_when_ready(files, rename_group_member_ready, output);
+}
+
+bool can_rename_file(const std::string &path)
 {
 	if (os_get_path_extension(path.c_str()) == nullptr) {
-		return;
+		return false;
 	}
 	bool autoRemux = config_get_bool(obs_frontend_get_profile_config(), "Video", "AutoRemux");
 	if (autoRemux) {
 		blog(LOG_INFO, "[Record Rename] AutoRemux is enabled, skipping rename.");
-		return;
+		return false;
 	}
 	if (!os_file_exists(path.c_str())) {
 		blog(LOG_ERROR, "[Record Rename] File not found: %s", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ask_rename_file(obs_output_t *output, std::string path)
+{
+	if (!can_rename_file(path))
 		return;
+	queue_when_ready({path}, ask_rename_file_UI, new rename_file_item{output, path}, free_rename_file_item);
+}
+
+static QTimer *replay_burst_timer = nullptr;
+
+struct replay_burst {
+	obs_output_t *output;
+	std::vector<std::string> files;
+};
+
+// only touched on the UI thread, unlike output_files
+static std::vector<replay_burst> replay_bursts;
+
+void flush_replay_burst()
+{
+	std::vector<replay_burst> bursts;
+	bursts.swap(replay_bursts);
+	for (const replay_burst &burst : bursts) {
+		rename_job job;
+		add_rename_entries(job, burst.output, burst.files, burst.files.size() > 1);
+		run_rename_job(job);
+	}
+}
+
+void replay_burst_ready(void *param)
+{
+	rename_file_item *item = (rename_file_item *)param;
+	if (replay_burst_timer && os_file_exists(item->path.c_str())) {
+		auto burst = std::find_if(replay_bursts.begin(), replay_bursts.end(),
+					  [item](const replay_burst &b) { return b.output == item->output; });
+		if (burst == replay_bursts.end())
+			replay_bursts.push_back({item->output, {item->path}});
+		else
+			burst->files.push_back(item->path);
+		// every save restarts the window
+		replay_burst_timer->start(replay_burst_window * 1000);
 	}
-	obs_queue_task(OBS_TASK_UI, ask_rename_file_UI, (void *)bstrdup(path.c_str()), false);
+	delete item;
+}
+
+// Replay saves that follow each other within replay_burst_window seconds are
+// renamed together as one numbered batch.
+void join_replay_burst(obs_output_t *output, const std::string &path)
+{
+	if (!can_rename_file(path))
+		return;
+	queue_when_ready({path}, replay_burst_ready, new rename_file_item{output, path}, free_rename_file_item);
 }
 
 void replay_saved(void *data, calldata_t *calldata)
@@ -309,32 +1064,63 @@ void replay_saved(void *data, calldata_t *calldata)
 	proc_handler_t *ph = obs_output_get_proc_handler(output);
 	proc_handler_call(ph, "get_last_replay", &cd);
 	const char *path = calldata_string(&cd, "path");
-	if (path)
-		ask_rename_file(path);
+	if (path && replay_burst_window > 0 && replay_burst_timer)
+		join_replay_burst(output, path);
+	else if (path)
+		ask_rename_file(output, path);
 	calldata_free(&cd);
 }
 
 void record_stop(void *data, calldata_t *calldata)
 {
 	UNUSED_PARAMETER(calldata);
+	obs_output_t *output = (obs_output_t *)data;
+	bool named_at_start = output == named_at_start_output;
+	if (named_at_start)
+		named_at_start_output = nullptr;
 	if (!rename_record_enabled)
 		return;
-	obs_output_t *output = (obs_output_t *)data;
 	auto t = output_files.find(output);
+	if (named_at_start) {
+		// the files were already written under their final name
+		std::vector<std::string> files;
+		if (t != output_files.end()) {
+			files = t->second;
+			output_files.erase(t);
+		} else {
+			obs_data_t *settings = obs_output_get_settings(output);
+			const char *path = obs_data_get_string(settings, "path");
+			if (path && strlen(path) && os_file_exists(path))
+				files.push_back(path);
+			obs_data_release(settings);
+		}
+		for (size_t i = 0; i < files.size(); i++)
+			queue_file_sidecar(files[i], files[i], output, files.size() > 1 ? i + 1 : 0);
+		bool obs_remux = config_get_bool(obs_frontend_get_profile_config(), "Video", "AutoRemux");
+		if ((auto_remux || audio_fanout) && !obs_remux)
+			queue_remux_files(files);
+		return;
+	}
 	if (t == output_files.end()) {
+		std::string file;
 		obs_data_t *settings = obs_output_get_settings(output);
 		const char *path = obs_data_get_string(settings, "path");
 		if (path && strlen(path) && os_file_exists(path)) {
-			ask_rename_file(path);
+			file = path;
 		} else {
 			const char *url = obs_data_get_string(settings, "url");
 			if (url && strlen(url) && os_file_exists(url)) {
-				ask_rename_file(url);
+				file = url;
 			}
 		}
 		obs_data_release(settings);
+		if (!file.empty() && can_rename_file(file))
+			join_rename_group(output, false, {file});
 	} else {
-		obs_queue_task(OBS_TASK_UI, ask_rename_files_UI, (void *)output, false);
+		// taken out now, a restarted output fills the map again before the group is renamed
+		std::vector<std::string> files = std::move(t->second);
+		output_files.erase(t);
+		join_rename_group(output, true, files);
 	}
 }
 
@@ -409,34 +1195,223 @@ void unloadOutputs()
 	obs_enum_outputs(loadOutput, &unload);
 }
 
+#define CONFIG_SAVE_DEBOUNCE_MS 1000
+
+static pthread_mutex_t config_mutex;
+static pthread_mutex_t config_save_mutex;
+static os_event_t *config_event = nullptr;
+static pthread_t config_thread;
+static bool config_thread_active = false;
+static volatile bool config_stopping = false;
+static config_t *config_dirty = nullptr;
+// guarded by config_save_mutex
+static bool config_save_held = false;
+
+// The settings above are the in-memory store read by every hot path, config
+// values are only read when a profile is loaded.
+void load_config(config_t *config)
+{
+	if (!config)
+		return;
+	config_set_default_bool(config, "RecordRename", "RenameRecord", true);
+	config_set_default_bool(config, "RecordRename", "RenameReplay", true);
+	config_set_default_bool(config, "RecordRename", "UserConfirm", true);
+	rename_record_enabled = config_get_bool(config, "RecordRename", "RenameRecord");
+	rename_replay_enabled = config_get_bool(config, "RecordRename", "RenameReplay");
+	user_confirm = config_get_bool(config, "RecordRename", "UserConfirm");
+	auto_remux = config_get_bool(config, "RecordRename", "AutoRemux");
+	name_at_start = config_get_bool(config, "RecordRename", "NameAtStart");
+	write_sidecar = config_get_bool(config, "RecordRename", "WriteSidecar");
+	remux_format = (int)config_get_int(config, "RecordRename", "RemuxFormat");
+	replay_keep_seconds = (int)config_get_int(config, "RecordRename", "ReplayKeepSeconds");
+	audio_fanout = (int)config_get_int(config, "RecordRename", "AudioTrackFanout");
+	replay_burst_window = (int)config_get_int(config, "RecordRename", "ReplayBurstWindow");
+	const char *ff = config_get_string(config, "RecordRename", "FilenameFormat");
+	if (ff)
+		filename_format = ff;
+}
+
+void flush_config()
+{
+	pthread_mutex_lock(&config_save_mutex);
+	if (config_save_held) {
+		pthread_mutex_unlock(&config_save_mutex);
+		return;
+	}
+	pthread_mutex_lock(&config_mutex);
+	config_t *config = config_dirty;
+	config_dirty = nullptr;
+	pthread_mutex_unlock(&config_mutex);
+	if (config) {
+		config_save(config);
+		blog(LOG_INFO, "[Record Rename] Config saved");
+	}
+	pthread_mutex_unlock(&config_save_mutex);
+}
+
+// Keeps the profile config from being saved while it holds a temporary value,
+// pending changes are saved once it is released.
+static void hold_config_save(bool hold)
+{
+	pthread_mutex_lock(&config_save_mutex);
+	config_save_held = hold;
+	pthread_mutex_unlock(&config_save_mutex);
+	if (!hold && config_event)
+		os_event_signal(config_event);
+}
+
+void *config_save_thread(void *param)
+{
+	UNUSED_PARAMETER(param);
+	os_set_thread_name("record-rename: config");
+	while (os_event_wait(config_event) == 0) {
+		// every change within the debounce period restarts it
+		while (!os_atomic_load_bool(&config_stopping) && os_event_timedwait(config_event, CONFIG_SAVE_DEBOUNCE_MS) == 0)
+			;
+		if (os_atomic_load_bool(&config_stopping))
+			break;
+		flush_config();
+	}
+	return nullptr;
+}
+
+void start_config_thread()
+{
+	pthread_mutex_init(&config_mutex, nullptr);
+	pthread_mutex_init(&config_save_mutex, nullptr);
+	os_atomic_set_bool(&config_stopping, false);
+	if (os_event_init(&config_event, OS_EVENT_TYPE_AUTO) != 0) {
+		config_event = nullptr;
+		return;
+	}
+	if (pthread_create(&config_thread, nullptr, config_save_thread, nullptr) == 0) {
+		config_thread_active = true;
+	} else {
+		os_event_destroy(config_event);
+		config_event = nullptr;
+	}
+}
+
+void stop_config_thread()
+{
+	os_atomic_set_bool(&config_stopping, true);
+	if (config_thread_active) {
+		os_event_signal(config_event);
+		pthread_join(config_thread, nullptr);
+		config_thread_active = false;
+	}
+	// the frontend owns the profile config and may have closed it already,
+	// pending changes were saved on OBS_FRONTEND_EVENT_EXIT
+	pthread_mutex_lock(&config_mutex);
+	config_dirty = nullptr;
+	pthread_mutex_unlock(&config_mutex);
+	if (config_event) {
+		os_event_destroy(config_event);
+		config_event = nullptr;
+	}
+	pthread_mutex_destroy(&config_save_mutex);
+	pthread_mutex_destroy(&config_mutex);
+}
+
+void restore_recording_filename_format()
+{
+	if (!restore_filename_formatting_pending)
+		return;
+	restore_filename_formatting_pending = false;
+	config_t *config = obs_frontend_get_profile_config();
+	if (config) {
+		config_set_string(config, "Output", "FilenameFormatting", restore_filename_formatting.c_str());
+		config_set_bool(config, "Output", "OverwriteIfExists", restore_overwrite_if_exists);
+	}
+	hold_config_save(false);
+}
+
+// Temporarily replaces the frontend filename formatting, with overwriting off, so the recording output
+// is configured with the final name and no rename is needed after it stops.
+// Returns true when the recording is named.
+bool apply_name_at_start()
+{
+	if (!name_at_start || !rename_record_enabled)
+		return false;
+	config_t *config = obs_frontend_get_profile_config();
+	if (!config)
+		return false;
+	const char *current = config_get_string(config, "Output", "FilenameFormatting");
+	std::string name;
+	if (!vendor_filename_format.empty()) {
+		name = hook_format(vendor_filename_format);
+		vendor_filename_format.clear();
+	} else {
+		name = hook_format(!filename_format.empty() ? filename_format : (current ? current : ""));
+		if (user_confirm) {
+			char *formatted = os_generate_formatted_filename(nullptr, true, name.c_str());
+			if (formatted) {
+				name = formatted;
+				bfree(formatted);
+			}
+			const auto main_window = static_cast<QWidget *>(obs_frontend_get_main_window());
+			if (!RenameFileDialog::AskForName(main_window, obs_module_text("RecordingName"), name))
+				return false;
+		}
+	}
+	sanitize_filename(name);
+	if (name.empty())
+		return false;
+	restore_filename_formatting = current ? current : "";
+	restore_overwrite_if_exists = config_get_bool(config, "Output", "OverwriteIfExists");
+	restore_filename_formatting_pending = true;
+	// a save now would leave the temporary name on disk after a crash
+	hold_config_save(true);
+	config_set_string(config, "Output", "FilenameFormatting", name.c_str());
+	// split segments reuse the fixed name and a name can already exist, the
+	// frontend and muxer then pick a numbered name instead of replacing the file
+	config_set_bool(config, "Output", "OverwriteIfExists", false);
+	// the frontend configures the output right after this event returns
+	QTimer::singleShot(0, [] { restore_recording_filename_format(); });
+	return true;
+}
+
 void frontend_event(obs_frontend_event event, void *param)
 {
 	UNUSED_PARAMETER(param);
 	switch (event) {
+	case OBS_FRONTEND_EVENT_RECORDING_STARTING:
+		named_at_start_output = nullptr;
+		recording_named_at_start = apply_name_at_start();
+		break;
 	case OBS_FRONTEND_EVENT_RECORDING_STARTED:
+		restore_recording_filename_format();
+		if (recording_named_at_start) {
+			obs_output_t *output = obs_frontend_get_recording_output();
+			named_at_start_output = output;
+			obs_output_release(output);
+		}
+		recording_named_at_start = false;
 		loadOutputs();
 		break;
+	case OBS_FRONTEND_EVENT_RECORDING_STOPPED:
+		// a recording that failed to start never sees RECORDING_STARTED
+		restore_recording_filename_format();
+		recording_named_at_start = false;
+		break;
 	case OBS_FRONTEND_EVENT_REPLAY_BUFFER_STARTED:
 		loadOutputs();
 		break;
+	case OBS_FRONTEND_EVENT_PROFILE_CHANGING:
+		// pending changes belong to the profile that is being left
+		restore_recording_filename_format();
+		flush_config();
+		break;
+	case OBS_FRONTEND_EVENT_EXIT:
+		// the profile config is gone by the time the module is unloaded
+		restore_recording_filename_format();
+		flush_config();
+		break;
 	case OBS_FRONTEND_EVENT_PROFILE_CHANGED:
-	case OBS_FRONTEND_EVENT_FINISHED_LOADING: {
-		config_t *config = obs_frontend_get_profile_config();
-		if (config) {
-			config_set_default_bool(config, "RecordRename", "RenameRecord", true);
-			config_set_default_bool(config, "RecordRename", "RenameReplay", true);
-			config_set_default_bool(config, "RecordRename", "UserConfirm", true);
-			rename_record_enabled = config_get_bool(config, "RecordRename", "RenameRecord");
-			rename_replay_enabled = config_get_bool(config, "RecordRename", "RenameReplay");
-			user_confirm = config_get_bool(config, "RecordRename", "UserConfirm");
-			auto_remux = config_get_bool(config, "RecordRename", "AutoRemux");
-			const char *ff = config_get_string(config, "RecordRename", "FilenameFormat");
-			if (ff)
-				filename_format = ff;
-		}
+	case OBS_FRONTEND_EVENT_FINISHED_LOADING:
+		load_config(obs_frontend_get_profile_config());
 		loadOutputs();
 		break;
-	}
 	default:
 		break;
 	}
@@ -445,16 +1420,27 @@ void frontend_event(obs_frontend_event event, void *param)
 void save_config()
 {
 	config_t *config = obs_frontend_get_profile_config();
-	if (config) {
-		config_set_bool(config, "RecordRename", "RenameRecord", rename_record_enabled);
-		config_set_bool(config, "RecordRename", "RenameReplay", rename_replay_enabled);
-		config_set_bool(config, "RecordRename", "UserConfirm", user_confirm);
-		config_set_string(config, "RecordRename", "FilenameFormat", filename_format.c_str());
-		config_set_bool(config, "RecordRename", "AutoRemux", auto_remux);
-	}
-	config_save(config);
-	blog(LOG_INFO, "[Record Rename] Config saved: %s %s %s %s", rename_record_enabled ? "true" : "false",
-	     rename_replay_enabled ? "true" : "false", user_confirm ? "true" : "false", auto_remux ? "true" : "false");
+	if (!config)
+		return;
+	config_set_bool(config, "RecordRename", "RenameRecord", rename_record_enabled);
+	config_set_bool(config, "RecordRename", "RenameReplay", rename_replay_enabled);
+	config_set_bool(config, "RecordRename", "UserConfirm", user_confirm);
+	config_set_string(config, "RecordRename", "FilenameFormat", filename_format.c_str());
+	config_set_bool(config, "RecordRename", "AutoRemux", auto_remux);
+	config_set_bool(config, "RecordRename", "NameAtStart", name_at_start);
+	config_set_bool(config, "RecordRename", "WriteSidecar", write_sidecar);
+	config_set_int(config, "RecordRename", "RemuxFormat", remux_format);
+	config_set_int(config, "RecordRename", "ReplayKeepSeconds", replay_keep_seconds);
+	config_set_int(config, "RecordRename", "AudioTrackFanout", audio_fanout);
+	config_set_int(config, "RecordRename", "ReplayBurstWindow", replay_burst_window);
+
+	pthread_mutex_lock(&config_mutex);
+	config_dirty = config;
+	pthread_mutex_unlock(&config_mutex);
+	if (config_event)
+		os_event_signal(config_event);
+	else
+		flush_config();
 }
 
 void hooked(void *data, calldata_t *calldata)
@@ -484,6 +1470,12 @@ bool obs_module_load()
 {
 	blog(LOG_INFO, "[Record Rename] loaded version %s", PROJECT_VERSION);
 
+	start_sidecar_thread();
+	start_ready_worker();
+	start_remux_worker();
+	pthread_mutex_init(&rename_group_mutex, nullptr);
+	start_config_thread();
+
 	obs_frontend_add_event_callback(frontend_event, nullptr);
 	signal_handler_connect(obs_get_signal_handler(), "source_create", source_create, nullptr);
 
@@ -492,6 +1484,10 @@ bool obs_module_load()
 	QObject::connect(timer, &QTimer::timeout, []() { loadOutputs(); });
 	timer->start();
 
+	replay_burst_timer = new QTimer();
+	replay_burst_timer->setSingleShot(true);
+	QObject::connect(replay_burst_timer, &QTimer::timeout, []() { flush_replay_burst(); });
+
 	QAction *action = static_cast<QAction *>(obs_frontend_add_tools_menu_qaction(obs_module_text("RecordRename")));
 	QMenu *menu = new QMenu();
 	auto recordAction = menu->addAction(QString::fromUtf8(obs_module_text("Record")), [] {
@@ -527,17 +1523,84 @@ bool obs_module_load()
 		save_config();
 	});
 	remuxAction->setCheckable(true);
+	QMenu *remuxFormatMenu = menu->addMenu(QString::fromUtf8(obs_module_text("RemuxFormat")));
+	QActionGroup *remuxFormatGroup = new QActionGroup(remuxFormatMenu);
+	const char *remuxFormatNames[] = {"RemuxFormat.MP4", "RemuxFormat.MP4Faststart", "RemuxFormat.FragmentedMP4",
+					  "RemuxFormat.MOV"};
+	for (int format = REMUX_FORMAT_MP4; format <= REMUX_FORMAT_MOV; format++) {
+		auto formatAction = remuxFormatMenu->addAction(QString::fromUtf8(obs_module_text(remuxFormatNames[format])), [format] {
+			remux_format = format;
+			save_config();
+		});
+		formatAction->setCheckable(true);
+		formatAction->setActionGroup(remuxFormatGroup);
+	}
+	QObject::connect(remuxFormatMenu, &QMenu::aboutToShow, [remuxFormatMenu] {
+		auto actions = remuxFormatMenu->actions();
+		for (int i = 0; i < actions.size(); i++)
+			actions[i]->setChecked(i == remux_format);
+	});
+	QMenu *audioTracksMenu = menu->addMenu(QString::fromUtf8(obs_module_text("AudioTrackFanout")));
+	// these are audio streams of the file, a recording only has the tracks enabled for its output
+	for (int track = 0; track < MAX_AUDIO_MIXES; track++) {
+		QString trackName = QString::fromUtf8(obs_module_text("AudioTrackFanout.Stream")).arg(track + 1);
+		auto trackAction = audioTracksMenu->addAction(trackName, [track] {
+			audio_fanout ^= 1 << track;
+			save_config();
+		});
+		trackAction->setCheckable(true);
+	}
+	QObject::connect(audioTracksMenu, &QMenu::aboutToShow, [audioTracksMenu] {
+		auto actions = audioTracksMenu->actions();
+		for (int i = 0; i < actions.size(); i++)
+			actions[i]->setChecked(audio_fanout & (1 << i));
+	});
+	auto nameAtStartAction = menu->addAction(QString::fromUtf8(obs_module_text("NameAtStart")), [] {
+		name_at_start = !name_at_start;
+		save_config();
+	});
+	nameAtStartAction->setCheckable(true);
+	menu->addAction(QString::fromUtf8(obs_module_text("ReplayKeepSeconds")), [] {
+		const auto main_window = static_cast<QWidget *>(obs_frontend_get_main_window());
+		bool ok = false;
+		int seconds = QInputDialog::getInt(main_window, QString::fromUtf8(obs_module_text("ReplayKeepSeconds")),
+						   QString::fromUtf8(obs_module_text("ReplayKeepSecondsText")), replay_keep_seconds, 0,
+						   3600, 1, &ok);
+		if (ok) {
+			replay_keep_seconds = seconds;
+			save_config();
+		}
+	});
+	auto sidecarAction = menu->addAction(QString::fromUtf8(obs_module_text("WriteSidecar")), [] {
+		write_sidecar = !write_sidecar;
+		save_config();
+	});
+	sidecarAction->setCheckable(true);
+	menu->addAction(QString::fromUtf8(obs_module_text("ReplayBurstWindow")), [] {
+		const auto main_window = static_cast<QWidget *>(obs_frontend_get_main_window());
+		bool ok = false;
+		int seconds = QInputDialog::getInt(main_window, QString::fromUtf8(obs_module_text("ReplayBurstWindow")),
+						   QString::fromUtf8(obs_module_text("ReplayBurstWindowSeconds")), replay_burst_window, 0,
+						   300, 1, &ok);
+		if (ok) {
+			replay_burst_window = seconds;
+			save_config();
+		}
+	});
 
 	menu->addSeparator();
 	menu->addAction(QString::fromUtf8("Record Rename (" PROJECT_VERSION ")"),
 			[] { QDesktopServices::openUrl(QUrl("https://obsproject.com/forum/resources/record-rename.2134/")); });
 	menu->addAction(QString::fromUtf8("By Exeldro"), [] { QDesktopServices::openUrl(QUrl("https://exeldro.com")); });
 	action->setMenu(menu);
-	QObject::connect(menu, &QMenu::aboutToShow, [recordAction, replayAction, remuxAction, confirmAction] {
+	QObject::connect(menu, &QMenu::aboutToShow, [recordAction, replayAction, remuxAction, confirmAction, nameAtStartAction,
+						     sidecarAction] {
 		recordAction->setChecked(rename_record_enabled);
 		replayAction->setChecked(rename_replay_enabled);
 		confirmAction->setChecked(user_confirm);
 		remuxAction->setChecked(auto_remux);
+		nameAtStartAction->setChecked(name_at_start);
+		sidecarAction->setChecked(write_sidecar);
 	});
 	return true;
 }
@@ -567,12 +1630,22 @@ void obs_module_post_load()
 void obs_module_unload(void)
 {
 	obs_frontend_remove_event_callback(frontend_event, nullptr);
+	unloadOutputs();
+	stop_ready_worker();
 	if (timer) {
 		timer->stop();
 		delete timer;
 		timer = nullptr;
 	}
-	unloadOutputs();
+	if (replay_burst_timer) {
+		replay_burst_timer->stop();
+		delete replay_burst_timer;
+		replay_burst_timer = nullptr;
+	}
+	stop_remux_worker();
+	stop_sidecar_thread();
+	pthread_mutex_destroy(&rename_group_mutex);
+	stop_config_thread();
 }
 
 RenameFileDialog::RenameFileDialog(QWidget *parent, std::string title) : QDialog(parent)
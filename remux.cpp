@@ -0,0 +1,494 @@
+#include "remux.hpp"
+#include <obs-module.h>
+#include <media-io/media-remux.h>
+#include <util/platform.h>
+#include <util/threading.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/version.h>
+#include <libavcodec/version.h>
+#include <libavutil/version.h>
+}
+
+#define MOOV_BYTES_BASE 65536
+#define MOOV_BYTES_PER_STREAM 4096
+#define MOOV_BYTES_PER_SAMPLE 32
+
+// FFmpeg is not linked. It is loaded at runtime, matching the major versions of the
+// headers, from the copy OBS already has loaded. Against an OBS with other FFmpeg
+// major versions the plugin still loads and falls back to the libobs remux.
+struct libav_api {
+	void *avformat;
+	void *avcodec;
+	void *avutil;
+	decltype(&::avformat_open_input) avformat_open_input;
+	decltype(&::avformat_find_stream_info) avformat_find_stream_info;
+	decltype(&::av_guess_format) av_guess_format;
+	decltype(&::avformat_alloc_output_context2) avformat_alloc_output_context2;
+	decltype(&::avformat_query_codec) avformat_query_codec;
+	decltype(&::avformat_new_stream) avformat_new_stream;
+	decltype(&::avio_open) avio_open;
+	decltype(&::avio_closep) avio_closep;
+	decltype(&::avformat_write_header) avformat_write_header;
+	decltype(&::av_find_best_stream) av_find_best_stream;
+	decltype(&::av_seek_frame) av_seek_frame;
+	decltype(&::av_read_frame) av_read_frame;
+	decltype(&::av_interleaved_write_frame) av_interleaved_write_frame;
+	decltype(&::av_write_trailer) av_write_trailer;
+	decltype(&::avio_size) avio_size;
+	decltype(&::avio_tell) avio_tell;
+	decltype(&::avformat_free_context) avformat_free_context;
+	decltype(&::avformat_close_input) avformat_close_input;
+	decltype(&::avcodec_parameters_copy) avcodec_parameters_copy;
+	decltype(&::av_packet_alloc) av_packet_alloc;
+	decltype(&::av_packet_free) av_packet_free;
+	decltype(&::av_packet_unref) av_packet_unref;
+	decltype(&::av_packet_ref) av_packet_ref;
+	decltype(&::av_packet_rescale_ts) av_packet_rescale_ts;
+	decltype(&::av_dict_set_int) av_dict_set_int;
+	decltype(&::av_dict_set) av_dict_set;
+	decltype(&::av_dict_free) av_dict_free;
+	decltype(&::av_rescale_q) av_rescale_q;
+};
+
+static libav_api av = {};
+static bool av_available = false;
+static pthread_once_t av_once = PTHREAD_ONCE_INIT;
+
+static void *open_libav(const char *name, int major)
+{
+	char path[256];
+#ifdef _WIN32
+	snprintf(path, sizeof(path), "%s-%d", name, major);
+#elif defined(__APPLE__)
+	snprintf(path, sizeof(path), "lib%s.%d.dylib", name, major);
+#else
+	snprintf(path, sizeof(path), "lib%s.so.%d", name, major);
+#endif
+	void *lib = os_dlopen(path);
+#ifdef __APPLE__
+	if (!lib) {
+		// bundled with OBS.app
+		snprintf(path, sizeof(path), "@executable_path/../Frameworks/lib%s.%d.dylib", name, major);
+		lib = os_dlopen(path);
+	}
+#endif
+	return lib;
+}
+
+#define LOAD_LIBAV_FUNC(lib, func)                                                    \
+	av.func = (decltype(av.func))os_dlsym(av.lib, #func);                         \
+	if (!av.func) {                                                               \
+		blog(LOG_WARNING, "[Record Rename] Could not load %s from FFmpeg", #func); \
+		return;                                                               \
+	}
+
+static void load_libav()
+{
+	av.avformat = open_libav("avformat", LIBAVFORMAT_VERSION_MAJOR);
+	av.avcodec = open_libav("avcodec", LIBAVCODEC_VERSION_MAJOR);
+	av.avutil = open_libav("avutil", LIBAVUTIL_VERSION_MAJOR);
+	if (!av.avformat || !av.avcodec || !av.avutil) {
+		blog(LOG_WARNING, "[Record Rename] FFmpeg with avformat %d, avcodec %d and avutil %d not found",
+		     LIBAVFORMAT_VERSION_MAJOR, LIBAVCODEC_VERSION_MAJOR, LIBAVUTIL_VERSION_MAJOR);
+		return;
+	}
+	LOAD_LIBAV_FUNC(avformat, avformat_open_input);
+	LOAD_LIBAV_FUNC(avformat, avformat_find_stream_info);
+	LOAD_LIBAV_FUNC(avformat, av_guess_format);
+	LOAD_LIBAV_FUNC(avformat, avformat_alloc_output_context2);
+	LOAD_LIBAV_FUNC(avformat, avformat_query_codec);
+	LOAD_LIBAV_FUNC(avformat, avformat_new_stream);
+	LOAD_LIBAV_FUNC(avformat, avio_open);
+	LOAD_LIBAV_FUNC(avformat, avio_closep);
+	LOAD_LIBAV_FUNC(avformat, avformat_write_header);
+	LOAD_LIBAV_FUNC(avformat, av_find_best_stream);
+	LOAD_LIBAV_FUNC(avformat, av_seek_frame);
+	LOAD_LIBAV_FUNC(avformat, av_read_frame);
+	LOAD_LIBAV_FUNC(avformat, av_interleaved_write_frame);
+	LOAD_LIBAV_FUNC(avformat, av_write_trailer);
+	LOAD_LIBAV_FUNC(avformat, avio_size);
+	LOAD_LIBAV_FUNC(avformat, avio_tell);
+	LOAD_LIBAV_FUNC(avformat, avformat_free_context);
+	LOAD_LIBAV_FUNC(avformat, avformat_close_input);
+	LOAD_LIBAV_FUNC(avcodec, avcodec_parameters_copy);
+	LOAD_LIBAV_FUNC(avcodec, av_packet_alloc);
+	LOAD_LIBAV_FUNC(avcodec, av_packet_free);
+	LOAD_LIBAV_FUNC(avcodec, av_packet_unref);
+	LOAD_LIBAV_FUNC(avcodec, av_packet_ref);
+	LOAD_LIBAV_FUNC(avcodec, av_packet_rescale_ts);
+	LOAD_LIBAV_FUNC(avutil, av_dict_set_int);
+	LOAD_LIBAV_FUNC(avutil, av_dict_set);
+	LOAD_LIBAV_FUNC(avutil, av_dict_free);
+	LOAD_LIBAV_FUNC(avutil, av_rescale_q);
+	av_available = true;
+}
+
+struct remux_track {
+	AVFormatContext *ofmt = nullptr;
+	std::string path;
+	// cleared once the track file has been moved to path
+	std::string part;
+};
+
+struct remux_context {
+	AVFormatContext *ifmt = nullptr;
+	AVFormatContext *ofmt = nullptr;
+	AVPacket *pkt = nullptr;
+	AVPacket *track_pkt = nullptr;
+	AVDictionary *opts = nullptr;
+	std::vector<remux_track> tracks;
+
+	~remux_context()
+	{
+		av.av_packet_free(&pkt);
+		av.av_packet_free(&track_pkt);
+		av.av_dict_free(&opts);
+		if (ofmt) {
+			if (!(ofmt->oformat->flags & AVFMT_NOFILE))
+				av.avio_closep(&ofmt->pb);
+			av.avformat_free_context(ofmt);
+		}
+		for (remux_track &track : tracks) {
+			if (track.ofmt) {
+				if (!(track.ofmt->oformat->flags & AVFMT_NOFILE))
+					av.avio_closep(&track.ofmt->pb);
+				av.avformat_free_context(track.ofmt);
+			}
+			if (!track.part.empty() && os_file_exists(track.part.c_str()))
+				os_unlink(track.part.c_str());
+		}
+		av.avformat_close_input(&ifmt);
+	}
+};
+
+const char *remux_format_extension(int format)
+{
+	return format == REMUX_FORMAT_MOV ? ".mov" : ".mp4";
+}
+
+static const char *track_format(AVCodecID codec_id, const char **extension)
+{
+	switch (codec_id) {
+	case AV_CODEC_ID_AAC:
+		*extension = ".m4a";
+		return "ipod";
+	case AV_CODEC_ID_OPUS:
+		*extension = ".opus";
+		return "ogg";
+	case AV_CODEC_ID_FLAC:
+		*extension = ".flac";
+		return "flac";
+	default:
+		*extension = ".mka";
+		return "matroska";
+	}
+}
+
+// every extension track_format can pick
+static const char *track_extensions[] = {".m4a", ".opus", ".flac", ".mka"};
+
+// <track_base>.track<n><ext>, the part is named like the one of the main output
+static std::string track_path(const char *track_base, int track, const char *extension, bool part)
+{
+	return std::string(track_base) + ".track" + std::to_string(track) + (part ? ".part" : "") + extension;
+}
+
+void remux_remove_track_parts(const char *track_base, unsigned int audio_tracks)
+{
+	for (int track = 1; track <= 32; track++) {
+		if (!(audio_tracks & (1u << (track - 1))))
+			continue;
+		for (const char *extension : track_extensions) {
+			std::string part = track_path(track_base, track, extension, true);
+			if (os_file_exists(part.c_str()))
+				os_unlink(part.c_str());
+		}
+	}
+}
+
+// Audio track n (1 based) goes next to the remux target.
+static bool open_track(remux_context &ctx, AVStream *in_stream, int track, const char *track_base)
+{
+	const char *extension = nullptr;
+	const char *format_name = track_format(in_stream->codecpar->codec_id, &extension);
+	remux_track &out = ctx.tracks.emplace_back();
+	out.path = track_path(track_base, track, extension, false);
+	out.part = track_path(track_base, track, extension, true);
+	if (av.avformat_alloc_output_context2(&out.ofmt, nullptr, format_name, out.part.c_str()) < 0 || !out.ofmt)
+		return false;
+	AVStream *out_stream = av.avformat_new_stream(out.ofmt, nullptr);
+	if (!out_stream || av.avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar) < 0)
+		return false;
+	out_stream->codecpar->codec_tag = 0;
+	out_stream->time_base = in_stream->time_base;
+	if (!(out.ofmt->oformat->flags & AVFMT_NOFILE) && av.avio_open(&out.ofmt->pb, out.part.c_str(), AVIO_FLAG_WRITE) < 0) {
+		blog(LOG_WARNING, "[Record Rename] Could not create %s", out.part.c_str());
+		return false;
+	}
+	return av.avformat_write_header(out.ofmt, nullptr) >= 0;
+}
+
+static int64_t estimate_sample_count(AVFormatContext *ctx, AVStream *stream)
+{
+	if (stream->nb_frames > 0)
+		return stream->nb_frames;
+	double duration = 0.0;
+	if (stream->duration > 0)
+		duration = (double)stream->duration * av_q2d(stream->time_base);
+	else if (ctx->duration > 0)
+		duration = (double)ctx->duration / AV_TIME_BASE;
+
+	double rate = 10.0;
+	if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+		AVRational fr = stream->avg_frame_rate.num ? stream->avg_frame_rate : stream->r_frame_rate;
+		rate = fr.num && fr.den ? av_q2d(fr) : 60.0;
+	} else if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+		int frame_size = stream->codecpar->frame_size > 0 ? stream->codecpar->frame_size : 1024;
+		rate = stream->codecpar->sample_rate > 0 ? (double)stream->codecpar->sample_rate / frame_size : 50.0;
+	}
+	return (int64_t)(duration * rate) + 1;
+}
+
+// Space reserved in front of the media data so the moov atom fits there in the
+// same pass, instead of moving it afterwards with a second faststart pass.
+static int64_t estimate_moov_size(AVFormatContext *ifmt, const std::vector<int> &stream_map)
+{
+	int64_t size = MOOV_BYTES_BASE;
+	for (unsigned int i = 0; i < ifmt->nb_streams; i++) {
+		if (stream_map[i] < 0)
+			continue;
+		size += MOOV_BYTES_PER_STREAM + estimate_sample_count(ifmt, ifmt->streams[i]) * MOOV_BYTES_PER_SAMPLE;
+	}
+	return size;
+}
+
+static bool open_output(remux_context &ctx, const char *in_filename, const char *out_filename, const remux_options &options,
+			bool reserve_moov, std::vector<int> &stream_map)
+{
+	const char *format_name = options.format == REMUX_FORMAT_MOV ? "mov" : "mp4";
+	if (options.format == REMUX_FORMAT_SOURCE) {
+		// trimming keeps the container of the source
+		auto oformat = av.av_guess_format(nullptr, in_filename, nullptr);
+		if (!oformat)
+			return false;
+		format_name = oformat->name;
+	}
+	if (av.avformat_alloc_output_context2(&ctx.ofmt, nullptr, format_name, out_filename) < 0 || !ctx.ofmt)
+		return false;
+
+	int stream_count = 0;
+	for (unsigned int i = 0; i < ctx.ifmt->nb_streams; i++) {
+		AVStream *in_stream = ctx.ifmt->streams[i];
+		AVCodecParameters *par = in_stream->codecpar;
+		if (par->codec_type != AVMEDIA_TYPE_VIDEO && par->codec_type != AVMEDIA_TYPE_AUDIO)
+			continue;
+		if (av.avformat_query_codec(ctx.ofmt->oformat, par->codec_id, FF_COMPLIANCE_NORMAL) == 0)
+			continue;
+		AVStream *out_stream = av.avformat_new_stream(ctx.ofmt, nullptr);
+		if (!out_stream || av.avcodec_parameters_copy(out_stream->codecpar, par) < 0)
+			return false;
+		out_stream->codecpar->codec_tag = 0;
+		out_stream->time_base = in_stream->time_base;
+		stream_map[i] = stream_count++;
+	}
+	if (!stream_count)
+		return false;
+
+	switch (options.format) {
+	case REMUX_FORMAT_MP4_FASTSTART:
+	case REMUX_FORMAT_MOV:
+		if (reserve_moov)
+			av.av_dict_set_int(&ctx.opts, "moov_size", estimate_moov_size(ctx.ifmt, stream_map), 0);
+		else
+			av.av_dict_set(&ctx.opts, "movflags", "faststart", 0);
+		break;
+	case REMUX_FORMAT_FRAGMENTED_MP4:
+		av.av_dict_set(&ctx.opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+		break;
+	default:
+		break;
+	}
+
+	if (!(ctx.ofmt->oformat->flags & AVFMT_NOFILE) && av.avio_open(&ctx.ofmt->pb, out_filename, AVIO_FLAG_WRITE) < 0) {
+		blog(LOG_WARNING, "[Record Rename] Could not create %s", out_filename);
+		return false;
+	}
+	return av.avformat_write_header(ctx.ofmt, &ctx.opts) >= 0;
+}
+
+static remux_result remux_pass(const char *in_filename, const char *out_filename, const remux_options &options,
+			       bool reserve_moov, remux_progress_callback callback, void *data)
+{
+	remux_context ctx;
+	if (av.avformat_open_input(&ctx.ifmt, in_filename, nullptr, nullptr) < 0) {
+		blog(LOG_WARNING, "[Record Rename] Could not open %s for remux", in_filename);
+		return REMUX_FAILED;
+	}
+	if (av.avformat_find_stream_info(ctx.ifmt, nullptr) < 0)
+		return REMUX_FAILED;
+
+	// seeking to the cut point means the trimmed off part is never read
+	bool trim = false;
+	if (options.keep_last_seconds > 0.0 && ctx.ifmt->duration > 0) {
+		int64_t keep = (int64_t)(options.keep_last_seconds * AV_TIME_BASE);
+		int64_t start_time = ctx.ifmt->start_time != AV_NOPTS_VALUE ? ctx.ifmt->start_time : 0;
+		if (ctx.ifmt->duration > keep)
+			trim = av.av_seek_frame(ctx.ifmt, -1, start_time + ctx.ifmt->duration - keep, AVSEEK_FLAG_BACKWARD) >= 0;
+	}
+	// a clip that is already short enough is left alone instead of being copied
+	if (options.format == REMUX_FORMAT_SOURCE && !trim && !options.audio_tracks)
+		return REMUX_UNCHANGED;
+
+	// without a trim the source container stays, only the selected tracks are written
+	bool write_output = options.format != REMUX_FORMAT_SOURCE || trim;
+	std::vector<int> stream_map(ctx.ifmt->nb_streams, -1);
+	if (write_output && !open_output(ctx, in_filename, out_filename, options, reserve_moov, stream_map))
+		return REMUX_FAILED;
+
+	// selected audio tracks are written to their own files from the same packets
+	std::vector<int> track_map(ctx.ifmt->nb_streams, -1);
+	// numbered by audio stream in the file, not by mixer track, OBS only writes the enabled tracks
+	int audio_stream = 0;
+	for (unsigned int i = 0; i < ctx.ifmt->nb_streams && options.audio_tracks && options.track_base; i++) {
+		if (ctx.ifmt->streams[i]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+			continue;
+		audio_stream++;
+		if (audio_stream > 32 || !(options.audio_tracks & (1u << (audio_stream - 1))))
+			continue;
+		if (!open_track(ctx, ctx.ifmt->streams[i], audio_stream, options.track_base))
+			return REMUX_FAILED;
+		track_map[i] = (int)ctx.tracks.size() - 1;
+	}
+	if (!write_output && ctx.tracks.empty())
+		return REMUX_UNCHANGED;
+	if (!ctx.tracks.empty()) {
+		ctx.track_pkt = av.av_packet_alloc();
+		if (!ctx.track_pkt)
+			return REMUX_FAILED;
+	}
+
+	int64_t trim_offset = AV_NOPTS_VALUE;
+	AVRational time_base = {1, AV_TIME_BASE};
+	int video_index = av.av_find_best_stream(ctx.ifmt, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+	if (video_index >= 0 && stream_map[video_index] < 0)
+		video_index = -1;
+
+	ctx.pkt = av.av_packet_alloc();
+	if (!ctx.pkt)
+		return REMUX_FAILED;
+	int64_t in_size = ctx.ifmt->pb ? av.avio_size(ctx.ifmt->pb) : 0;
+	while (av.av_read_frame(ctx.ifmt, ctx.pkt) >= 0) {
+		int index = ctx.pkt->stream_index;
+		if (index < 0 || index >= (int)stream_map.size() || (stream_map[index] < 0 && track_map[index] < 0)) {
+			av.av_packet_unref(ctx.pkt);
+			continue;
+		}
+		AVStream *in_stream = ctx.ifmt->streams[index];
+		if (trim) {
+			if (trim_offset == AV_NOPTS_VALUE) {
+				bool keyframe = video_index < 0 || (index == video_index && (ctx.pkt->flags & AV_PKT_FLAG_KEY));
+				if (!keyframe || ctx.pkt->dts == AV_NOPTS_VALUE) {
+					av.av_packet_unref(ctx.pkt);
+					continue;
+				}
+				trim_offset = av.av_rescale_q(ctx.pkt->dts, in_stream->time_base, time_base);
+			}
+			int64_t offset = av.av_rescale_q(trim_offset, time_base, in_stream->time_base);
+			if (ctx.pkt->dts != AV_NOPTS_VALUE && ctx.pkt->dts < offset) {
+				av.av_packet_unref(ctx.pkt);
+				continue;
+			}
+			if (ctx.pkt->dts != AV_NOPTS_VALUE)
+				ctx.pkt->dts -= offset;
+			if (ctx.pkt->pts != AV_NOPTS_VALUE)
+				ctx.pkt->pts -= offset;
+		}
+		ctx.pkt->pos = -1;
+		if (track_map[index] >= 0) {
+			AVFormatContext *track_ofmt = ctx.tracks[track_map[index]].ofmt;
+			if (av.av_packet_ref(ctx.track_pkt, ctx.pkt) < 0)
+				return REMUX_FAILED;
+			av.av_packet_rescale_ts(ctx.track_pkt, in_stream->time_base, track_ofmt->streams[0]->time_base);
+			ctx.track_pkt->stream_index = 0;
+			if (av.av_interleaved_write_frame(track_ofmt, ctx.track_pkt) < 0)
+				return REMUX_FAILED;
+		}
+		if (stream_map[index] < 0) {
+			av.av_packet_unref(ctx.pkt);
+		} else {
+			AVStream *out_stream = ctx.ofmt->streams[stream_map[index]];
+			av.av_packet_rescale_ts(ctx.pkt, in_stream->time_base, out_stream->time_base);
+			ctx.pkt->stream_index = stream_map[index];
+			if (av.av_interleaved_write_frame(ctx.ofmt, ctx.pkt) < 0)
+				return REMUX_FAILED;
+		}
+		if (callback && in_size > 0 && !callback(data, 100.0f * (float)av.avio_tell(ctx.ifmt->pb) / (float)in_size))
+			return REMUX_CANCELED;
+	}
+
+	if (write_output && av.av_write_trailer(ctx.ofmt) < 0)
+		return reserve_moov ? REMUX_MOOV_TOO_SMALL : REMUX_FAILED;
+	for (remux_track &track : ctx.tracks) {
+		if (av.av_write_trailer(track.ofmt) < 0)
+			return REMUX_FAILED;
+		if (!(track.ofmt->oformat->flags & AVFMT_NOFILE))
+			av.avio_closep(&track.ofmt->pb);
+		if (os_rename(track.part.c_str(), track.path.c_str()) != 0)
+			return REMUX_FAILED;
+		track.part.clear();
+	}
+	if (callback)
+		callback(data, 100.0f);
+	return write_output ? REMUX_SUCCESS : REMUX_UNCHANGED;
+}
+
+// The container follows the extension of out_filename.
+static bool libobs_remux(const char *in_filename, const char *out_filename, remux_progress_callback callback, void *data)
+{
+	media_remux_job_t job = nullptr;
+	if (!media_remux_job_create(&job, in_filename, out_filename))
+		return false;
+	bool success = media_remux_job_process(job, callback, data);
+	media_remux_job_destroy(job);
+	return success;
+}
+
+static remux_result remux(const char *in_filename, const char *out_filename, const remux_options &options,
+			  remux_progress_callback callback, void *data)
+{
+	// plain MP4 is what libobs does as well
+	bool needs_libav = options.format != REMUX_FORMAT_MP4 || options.keep_last_seconds > 0.0 || options.audio_tracks;
+	if (needs_libav)
+		pthread_once(&av_once, load_libav);
+	if (!needs_libav || !av_available) {
+		if (options.format == REMUX_FORMAT_SOURCE) {
+			blog(LOG_WARNING, "[Record Rename] FFmpeg is not available to trim or extract tracks from %s", in_filename);
+			return REMUX_FAILED;
+		}
+		if (needs_libav)
+			blog(LOG_WARNING, "[Record Rename] FFmpeg is not available, %s is remuxed without format options, trim or tracks",
+			     in_filename);
+		return libobs_remux(in_filename, out_filename, callback, data) ? REMUX_SUCCESS : REMUX_FAILED;
+	}
+
+	bool reserve_moov = options.format == REMUX_FORMAT_MP4_FASTSTART || options.format == REMUX_FORMAT_MOV;
+	remux_result result = remux_pass(in_filename, out_filename, options, reserve_moov, callback, data);
+	if (result == REMUX_MOOV_TOO_SMALL) {
+		blog(LOG_WARNING, "[Record Rename] Reserved moov space too small for %s, using faststart", out_filename);
+		result = remux_pass(in_filename, out_filename, options, false, callback, data);
+	}
+	return result;
+}
+
+remux_result remux_file(const char *in_filename, const char *out_filename, const remux_options &options,
+			remux_progress_callback callback, void *data)
+{
+	remux_result result = remux(in_filename, out_filename, options, callback, data);
+	if (result != REMUX_SUCCESS && os_file_exists(out_filename))
+		os_unlink(out_filename);
+	return result;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+enum remux_format {
+	REMUX_FORMAT_SOURCE = -1,
+	REMUX_FORMAT_MP4,
+	REMUX_FORMAT_MP4_FASTSTART,
+	REMUX_FORMAT_FRAGMENTED_MP4,
+	REMUX_FORMAT_MOV,
+};
+
+struct remux_options {
+	int format;
+	// only keep this many seconds from the end, starting at a video keyframe
+	double keep_last_seconds;
+	// bit n set writes the audio stream n + 1 of the file to its own file named after track_base
+	unsigned int audio_tracks;
+	const char *track_base;
+};
+
+enum remux_result {
+	REMUX_SUCCESS,
+	REMUX_FAILED,
+	REMUX_CANCELED,
+	// nothing to trim and the container stays, out_filename is not written but selected tracks are
+	REMUX_UNCHANGED,
+	// only used inside remux_file
+	REMUX_MOOV_TOO_SMALL,
+};
+
+typedef bool (*remux_progress_callback)(void *data, float percent);
+
+const char *remux_format_extension(int format);
+
+// Removes the partial track files an interrupted remux_file left for track_base.
+void remux_remove_track_parts(const char *track_base, unsigned int audio_tracks);
+
+// Remuxes in_filename into out_filename in a single pass without re-encoding.
+// out_filename needs the extension of the target container.
+// The callback can return false to cancel, the partial output is removed then.
+remux_result remux_file(const char *in_filename, const char *out_filename, const remux_options &options,
+			remux_progress_callback callback, void *data);
@@ -0,0 +1,414 @@
+// Soak harness for the Record Rename plugin. The plugin sources are built into
+// this executable, which stands in for the OBS frontend. It fires a burst of
+// replay buffer saves and a split recording stop at the same moment against a
+// temp directory and auto-answers the rename dialogs. It then reports the
+// maximum and p99 UI thread blocking time, the end-to-end rename latency and
+// the peak memory.
+//
+// record-rename-soak [--replays N] [--segments N] [--burst-window S]
+//                    [--dialog-delay-ms N] [--timeout-s N]
+
+#include <obs-frontend-api.h>
+#include <obs-module.h>
+#include <QAction>
+#include <QApplication>
+#include <QDialog>
+#include <QElapsedTimer>
+#include <QLineEdit>
+#include <QMainWindow>
+#include <QPointer>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <util/config-file.h>
+#include <util/platform.h>
+
+#define HEARTBEAT_INTERVAL_MS 1
+#define SAMPLE_INTERVAL_MS 5
+#define FILE_SIZE 262144
+
+struct soak_options {
+	int replays = 50;
+	int segments = 30;
+	int burst_window = 0;
+	int dialog_delay_ms = 0;
+	int timeout_s = 120;
+};
+
+struct soak_output {
+	obs_output_t *output;
+	std::string last_replay;
+};
+
+struct pending_file {
+	std::string path;
+	uint64_t start;
+	uint64_t done;
+};
+
+static QMainWindow *main_window = nullptr;
+static config_t *profile_config = nullptr;
+static obs_output_t *recording_output = nullptr;
+static std::vector<std::pair<obs_frontend_event_cb, void *>> event_callbacks;
+
+static std::mutex pending_mutex;
+static std::vector<pending_file> pending_files;
+static std::atomic<uint64_t> peak_resident_size{0};
+static std::atomic<bool> sampling{true};
+
+// The frontend functions used by the plugin, answered by the harness instead of OBS.
+void *obs_frontend_get_main_window(void)
+{
+	return main_window;
+}
+
+config_t *obs_frontend_get_profile_config(void)
+{
+	return profile_config;
+}
+
+obs_output_t *obs_frontend_get_recording_output(void)
+{
+	return obs_output_get_ref(recording_output);
+}
+
+void obs_frontend_add_event_callback(obs_frontend_event_cb callback, void *private_data)
+{
+	event_callbacks.emplace_back(callback, private_data);
+}
+
+void obs_frontend_remove_event_callback(obs_frontend_event_cb callback, void *private_data)
+{
+	event_callbacks.erase(std::remove(event_callbacks.begin(), event_callbacks.end(), std::make_pair(callback, private_data)),
+			      event_callbacks.end());
+}
+
+void *obs_frontend_add_tools_menu_qaction(const char *name)
+{
+	return new QAction(QString::fromUtf8(name), main_window);
+}
+
+const char *obs_frontend_get_locale_string(const char *string)
+{
+	return string;
+}
+
+static void dispatch_event(obs_frontend_event event)
+{
+	auto callbacks = event_callbacks;
+	for (auto &callback : callbacks)
+		callback.first(event, callback.second);
+}
+
+static void ui_task_handler(obs_task_t task, void *param, bool wait)
+{
+	auto run = [task, param] { task(param); };
+	if (wait && QThread::currentThread() == qApp->thread())
+		run();
+	else
+		QMetaObject::invokeMethod(qApp, run, wait ? Qt::BlockingQueuedConnection : Qt::QueuedConnection);
+}
+
+static const char *soak_output_name(void *type_data)
+{
+	UNUSED_PARAMETER(type_data);
+	return "Soak Output";
+}
+
+static void soak_get_last_replay(void *data, calldata_t *cd)
+{
+	calldata_set_string(cd, "path", ((soak_output *)data)->last_replay.c_str());
+}
+
+static void *soak_output_create(obs_data_t *settings, obs_output_t *output)
+{
+	UNUSED_PARAMETER(settings);
+	soak_output *so = new soak_output{output, std::string()};
+	signal_handler_t *sh = obs_output_get_signal_handler(output);
+	signal_handler_add(sh, "void saved()");
+	signal_handler_add(sh, "void file_changed(string next_file)");
+	proc_handler_add(obs_output_get_proc_handler(output), "void get_last_replay(out string path)", soak_get_last_replay, so);
+	return so;
+}
+
+static void soak_output_destroy(void *data)
+{
+	delete (soak_output *)data;
+}
+
+static bool soak_output_start(void *data)
+{
+	UNUSED_PARAMETER(data);
+	return false;
+}
+
+static void soak_output_stop(void *data, uint64_t ts)
+{
+	UNUSED_PARAMETER(data);
+	UNUSED_PARAMETER(ts);
+}
+
+static void register_output(const char *id)
+{
+	struct obs_output_info info = {};
+	info.id = id;
+	info.get_name = soak_output_name;
+	info.create = soak_output_create;
+	info.destroy = soak_output_destroy;
+	info.start = soak_output_start;
+	info.stop = soak_output_stop;
+	obs_register_output(&info);
+}
+
+static bool write_file(const std::string &path)
+{
+	FILE *f = os_fopen(path.c_str(), "wb");
+	if (!f)
+		return false;
+	std::vector<char> data(FILE_SIZE, 0);
+	bool success = fwrite(data.data(), 1, data.size(), f) == data.size();
+	fclose(f);
+	return success;
+}
+
+static void add_pending(const std::string &path, uint64_t start)
+{
+	std::lock_guard<std::mutex> lock(pending_mutex);
+	pending_files.push_back({path, start, 0});
+}
+
+static void emit_replays(const std::string &dir, int count)
+{
+	obs_output_t *output = obs_get_output_by_name("Replay Buffer");
+	soak_output *so = (soak_output *)obs_obj_get_data(output);
+	signal_handler_t *sh = obs_output_get_signal_handler(output);
+	for (int i = 0; i < count; i++) {
+		std::string path = dir + "/replay-" + std::to_string(i) + ".mkv";
+		if (!write_file(path))
+			continue;
+		so->last_replay = path;
+		add_pending(path, os_gettime_ns());
+		calldata_t cd = {0};
+		signal_handler_signal(sh, "saved", &cd);
+		calldata_free(&cd);
+	}
+	obs_output_release(output);
+}
+
+static void emit_split_recording(const std::string &dir, int segments)
+{
+	std::vector<std::string> files;
+	for (int i = 0; i < segments; i++) {
+		std::string path = dir + "/recording-" + std::to_string(i) + ".mkv";
+		if (write_file(path))
+			files.push_back(path);
+	}
+	if (files.empty())
+		return;
+	obs_data_t *settings = obs_data_create();
+	obs_data_set_string(settings, "path", files.front().c_str());
+	obs_output_update(recording_output, settings);
+	obs_data_release(settings);
+
+	signal_handler_t *sh = obs_output_get_signal_handler(recording_output);
+	for (size_t i = 1; i < files.size(); i++) {
+		calldata_t cd = {0};
+		calldata_set_string(&cd, "next_file", files[i].c_str());
+		signal_handler_signal(sh, "file_changed", &cd);
+		calldata_free(&cd);
+	}
+	uint64_t start = os_gettime_ns();
+	for (const std::string &file : files)
+		add_pending(file, start);
+	calldata_t cd = {0};
+	calldata_set_ptr(&cd, "output", recording_output);
+	calldata_set_int(&cd, "code", 0);
+	signal_handler_signal(sh, "stop", &cd);
+	calldata_free(&cd);
+}
+
+// A file counts as renamed once it is gone from its original path.
+static bool update_pending()
+{
+	std::lock_guard<std::mutex> lock(pending_mutex);
+	bool done = true;
+	for (pending_file &file : pending_files) {
+		if (!file.done && !os_file_exists(file.path.c_str()))
+			file.done = os_gettime_ns();
+		if (!file.done)
+			done = false;
+	}
+	return done;
+}
+
+static void sample_thread(size_t expected, uint64_t deadline)
+{
+	while (sampling) {
+		uint64_t resident = os_get_proc_resident_size();
+		if (resident > peak_resident_size)
+			peak_resident_size = resident;
+		size_t count;
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+			count = pending_files.size();
+		}
+		if ((update_pending() && count == expected) || os_gettime_ns() > deadline)
+			break;
+		os_sleep_ms(SAMPLE_INTERVAL_MS);
+	}
+	QMetaObject::invokeMethod(qApp, [] { QApplication::quit(); }, Qt::QueuedConnection);
+}
+
+static double percentile_ms(std::vector<uint64_t> samples, double percentile)
+{
+	if (samples.empty())
+		return 0.0;
+	size_t index = std::min(samples.size() - 1, (size_t)(samples.size() * percentile));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return (double)samples[index] / 1000000.0;
+}
+
+static double max_ms(const std::vector<uint64_t> &samples)
+{
+	return samples.empty() ? 0.0 : (double)*std::max_element(samples.begin(), samples.end()) / 1000000.0;
+}
+
+static soak_options parse_options(int argc, char *argv[])
+{
+	soak_options options;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		int value = atoi(argv[i + 1]);
+		if (strcmp(argv[i], "--replays") == 0)
+			options.replays = value;
+		else if (strcmp(argv[i], "--segments") == 0)
+			options.segments = value;
+		else if (strcmp(argv[i], "--burst-window") == 0)
+			options.burst_window = value;
+		else if (strcmp(argv[i], "--dialog-delay-ms") == 0)
+			options.dialog_delay_ms = value;
+		else if (strcmp(argv[i], "--timeout-s") == 0)
+			options.timeout_s = value;
+		else
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+	}
+	return options;
+}
+
+int main(int argc, char *argv[])
+{
+	soak_options options = parse_options(argc, argv);
+	if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	QApplication app(argc, argv);
+	QTemporaryDir temp_dir;
+	if (!temp_dir.isValid())
+		return 1;
+	std::string dir = temp_dir.path().toUtf8().constData();
+
+	if (!obs_startup("en-US", dir.c_str(), nullptr))
+		return 1;
+	obs_set_ui_task_handler(ui_task_handler);
+	register_output("replay_buffer");
+	register_output("soak_recording");
+
+	profile_config = config_create((dir + "/basic.ini").c_str());
+	config_set_bool(profile_config, "RecordRename", "RenameRecord", true);
+	config_set_bool(profile_config, "RecordRename", "RenameReplay", true);
+	config_set_bool(profile_config, "RecordRename", "UserConfirm", true);
+	config_set_int(profile_config, "RecordRename", "ReplayBurstWindow", options.burst_window);
+
+	main_window = new QMainWindow();
+	obs_output_t *replay_output = obs_output_create("replay_buffer", "Replay Buffer", nullptr, nullptr);
+	recording_output = obs_output_create("soak_recording", "Recording", nullptr, nullptr);
+
+	obs_module_load();
+	obs_module_post_load();
+	dispatch_event(OBS_FRONTEND_EVENT_FINISHED_LOADING);
+
+	// every dialog gets a unique name so each file is moved
+	int answers = 0;
+	QPointer<QDialog> open_dialog;
+	QElapsedTimer dialog_open;
+	QTimer answer_timer;
+	QObject::connect(&answer_timer, &QTimer::timeout, [&] {
+		QDialog *dialog = qobject_cast<QDialog *>(QApplication::activeModalWidget());
+		if (!dialog)
+			return;
+		if (dialog != open_dialog) {
+			open_dialog = dialog;
+			dialog_open.start();
+		}
+		if (dialog_open.elapsed() < options.dialog_delay_ms)
+			return;
+		QLineEdit *edit = dialog->findChild<QLineEdit *>();
+		if (edit)
+			edit->setText(QString("soak-%1").arg(++answers));
+		dialog->accept();
+	});
+	answer_timer.start(SAMPLE_INTERVAL_MS);
+
+	// lateness of a short timer is how long the UI thread was blocked
+	std::vector<uint64_t> ui_blocks;
+	QElapsedTimer heartbeat_clock;
+	qint64 last_beat = 0;
+	QTimer heartbeat;
+	heartbeat.setTimerType(Qt::PreciseTimer);
+	QObject::connect(&heartbeat, &QTimer::timeout, [&] {
+		qint64 now = heartbeat_clock.nsecsElapsed();
+		qint64 late = now - last_beat - HEARTBEAT_INTERVAL_MS * 1000000;
+		ui_blocks.push_back(late > 0 ? (uint64_t)late : 0);
+		last_beat = now;
+	});
+	heartbeat_clock.start();
+	heartbeat.start(HEARTBEAT_INTERVAL_MS);
+
+	size_t expected = (size_t)std::max(options.replays, 0) + (size_t)std::max(options.segments, 0);
+	uint64_t deadline = os_gettime_ns() + (uint64_t)options.timeout_s * 1000000000ULL;
+	std::thread sampler(sample_thread, expected, deadline);
+	// both bursts land at the same moment, from their own output threads
+	std::thread replays(emit_replays, dir, options.replays);
+	std::thread recording(emit_split_recording, dir, options.segments);
+
+	app.exec();
+	sampling = false;
+	replays.join();
+	recording.join();
+	sampler.join();
+	heartbeat.stop();
+	answer_timer.stop();
+
+	obs_module_unload();
+
+	std::vector<uint64_t> latencies;
+	size_t renamed = 0;
+	update_pending();
+	for (const pending_file &file : pending_files) {
+		if (!file.done)
+			continue;
+		renamed++;
+		latencies.push_back(file.done - file.start);
+	}
+	printf("files renamed          %zu/%zu\n", renamed, expected);
+	printf("dialogs answered       %d\n", answers);
+	printf("ui block max           %.2f ms\n", max_ms(ui_blocks));
+	printf("ui block p99           %.2f ms\n", percentile_ms(ui_blocks, 0.99));
+	printf("rename latency max     %.2f ms\n", max_ms(latencies));
+	printf("rename latency p99     %.2f ms\n", percentile_ms(latencies, 0.99));
+	printf("peak resident size     %.1f MB\n", (double)peak_resident_size / (1024.0 * 1024.0));
+
+	obs_output_release(replay_output);
+	obs_output_release(recording_output);
+	delete main_window;
+	config_close(profile_config);
+	obs_shutdown();
+	return renamed == expected ? 0 : 1;
+}